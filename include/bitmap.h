@@ -0,0 +1,113 @@
+#ifndef __BITMAP_H_
+#define __BITMAP_H_
+
+#include "types.h"
+
+// Bitmaps of 64-bit words, bit n lives in bit (n % 64) of word n / 64.
+// Searches skip whole words at a time and find the bit within a word
+// with ctz. Only depends on types.h, so it builds on the host as well.
+
+#define BITS_PER_WORD 64
+#define BIT_WORD(nr) ((nr) / BITS_PER_WORD)
+#define BIT_MASK(nr) (1UL << ((nr) % BITS_PER_WORD))
+
+// mask of bits [start % 64, 64) of the first word of a range
+#define BITMAP_FIRST_WORD_MASK(start) (~0UL << ((start) % BITS_PER_WORD))
+// mask of bits [0, end % 64) of the last word of a range, all if aligned
+#define BITMAP_LAST_WORD_MASK(end) (~0UL >> (-(end) % BITS_PER_WORD))
+
+static inline int bitmap_test(const uint64_t *map, uint64_t nr) {
+	return (map[BIT_WORD(nr)] & BIT_MASK(nr)) != 0;
+}
+
+static inline void bitmap_set(uint64_t *map, uint64_t nr) {
+	map[BIT_WORD(nr)] |= BIT_MASK(nr);
+}
+
+static inline void bitmap_clear(uint64_t *map, uint64_t nr) {
+	map[BIT_WORD(nr)] &= ~BIT_MASK(nr);
+}
+
+// Set bits [start, start + n).
+static inline void bitmap_set_range(uint64_t *map, uint64_t start, uint64_t n) {
+	uint64_t *p	   = map + BIT_WORD(start);
+	uint64_t  end  = start + n;
+	uint64_t  mask = BITMAP_FIRST_WORD_MASK(start);
+
+	if (n == 0)
+		return;
+	for (; BIT_WORD(start) < BIT_WORD(end - 1); start = (start | 63) + 1) {
+		*p++ |= mask;
+		mask = ~0UL;
+	}
+	*p |= mask & BITMAP_LAST_WORD_MASK(end);
+}
+
+// Clear bits [start, start + n).
+static inline void
+bitmap_clear_range(uint64_t *map, uint64_t start, uint64_t n) {
+	uint64_t *p	   = map + BIT_WORD(start);
+	uint64_t  end  = start + n;
+	uint64_t  mask = BITMAP_FIRST_WORD_MASK(start);
+
+	if (n == 0)
+		return;
+	for (; BIT_WORD(start) < BIT_WORD(end - 1); start = (start | 63) + 1) {
+		*p++ &= ~mask;
+		mask = ~0UL;
+	}
+	*p &= ~(mask & BITMAP_LAST_WORD_MASK(end));
+}
+
+// Index of the first bit in [start, size) whose value is not `invert`,
+// or size if there is none. Words that are all `invert` are skipped.
+static inline uint64_t __bitmap_find_next(const uint64_t *map, uint64_t size,
+										  uint64_t start, uint64_t invert) {
+	uint64_t word;
+
+	if (start >= size)
+		return size;
+
+	word = (map[BIT_WORD(start)] ^ invert) & BITMAP_FIRST_WORD_MASK(start);
+	start &= ~63UL;
+	while (word == 0) {
+		start += BITS_PER_WORD;
+		if (start >= size)
+			return size;
+		word = map[BIT_WORD(start)] ^ invert;
+	}
+
+	start += __builtin_ctzl(word);
+	return start < size ? start : size;
+}
+
+// Index of the first set bit in [start, size), or size.
+static inline uint64_t
+bitmap_find_next_set(const uint64_t *map, uint64_t size, uint64_t start) {
+	return __bitmap_find_next(map, size, start, 0);
+}
+
+// Index of the first clear bit in [start, size), or size.
+static inline uint64_t
+bitmap_find_next_zero(const uint64_t *map, uint64_t size, uint64_t start) {
+	return __bitmap_find_next(map, size, start, ~0UL);
+}
+
+// Index of the first run of n clear bits in [start, size), or size.
+static inline uint64_t bitmap_find_zero_area(const uint64_t *map,
+											 uint64_t size, uint64_t start,
+											 uint64_t n) {
+	uint64_t end;
+
+	for (;;) {
+		start = bitmap_find_next_zero(map, size, start);
+		if (start + n > size)
+			return size;
+		end = bitmap_find_next_set(map, start + n, start);
+		if (end == start + n)
+			return start;
+		start = end + 1; // the run is too short, go past the set bit
+	}
+}
+
+#endif /* __BITMAP_H_ */
@@ -1,6 +1,8 @@
 #ifndef __CPU_H_
 #define __CPU_H_
 
+#include "list.h"
+#include "spinlock.h"
 #include "types.h"
 
 // Saved registers for kernel context switches.
@@ -29,6 +31,14 @@ struct cpu {
 	struct context context; // swtch() here to enter scheduler().
 	int			   noff;	// Depth of push_off() nesting.
 	int			   intena;	// Were interrupts enabled before push_off()?
+
+	struct spinlock	 rq_lock;	  // protects runqueue and nr_running
+	struct list_head runqueue;	  // RUNNABLE procs waiting for this cpu
+	int				 nr_running;  // length of runqueue
+	uint64_t		 nr_switches; // procs run by scheduler()
+	uint64_t		 nr_steals;	  // procs taken from other cpus' queues
+
+	uint64_t timer_next; // time the timer of this cpu is set to
 };
 
 #endif // __CPU_H_
\ No newline at end of file
@@ -9,6 +9,18 @@
 #define O_CREATE  0x200
 #define O_TRUNC   0x400
 
+#define PROT_NONE  0x0
+#define PROT_READ  0x1
+#define PROT_WRITE 0x2
+#define PROT_EXEC  0x4
+
+#define MAP_SHARED    0x01
+#define MAP_PRIVATE   0x02
+#define MAP_FIXED     0x10
+#define MAP_ANONYMOUS 0x20
+
+#define MAP_FAILED ((void *)-1)
+
 /* clang-format on */
 
 #endif /* __FCNTL_H_ */
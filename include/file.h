@@ -2,6 +2,8 @@
 #define __FILE_H_
 
 #include "fs.h"
+#include "list.h"
+#include "rcu.h"
 #include "sleeplock.h"
 
 struct file {
@@ -24,6 +26,10 @@ struct inode {
 	uint			 dev;	// Device number
 	uint			 inum;	// Inode number
 	int				 ref;	// Reference count
+	struct list_head list;	// link in itable, protected by itable.lock
+	struct rcu_head	 rcu;	// frees it once lockless lookups are done
+	struct list_head pages;	// page cache of mapped pages, see ipage_get()
+	int				 writecount; // > 0: open for writing, < 0: being executed
 	struct sleeplock lock;	// protects everything below here
 	int				 valid; // inode has been read from disk?
 
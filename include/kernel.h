@@ -13,6 +13,8 @@ struct spinlock;
 struct sleeplock;
 struct stat;
 struct superblock;
+struct tlb_batch;
+struct vma;
 
 // defined by *.ld linker file
 extern char stext[];
@@ -42,12 +44,17 @@ void console_putchar(int);
 void console_print(const char *b);
 
 // timer.c
-void timerinit();
-void set_next_timeout();
-void timer_tick();
+void	 timerinit();
+void	 ticks_sync(void);
+uint64_t ticks_read(void);
+void	 set_next_timeout();
+int		 timer_tick();
+void	 timer_start_slice(void);
 
 // exec.c
 int exec(char *, char **);
+struct exec_seg *exec_seg_of(struct proc *, uint64_t);
+int				 exec_loadpage(struct proc *, struct exec_seg *, uint64_t);
 
 // file.c
 struct file *filealloc(void);
@@ -77,6 +84,12 @@ int			  readi(struct inode *, int, uint64_t, uint, uint);
 void		  stati(struct inode *, struct stat *);
 int			  writei(struct inode *, int, uint64_t, uint, uint);
 void		  itrunc(struct inode *);
+void		 *ipage_get(struct inode *, uint);
+void		  ipage_drop(struct inode *);
+int			  get_write_access(struct inode *);
+void		  put_write_access(struct inode *);
+int			  deny_write_access(struct inode *);
+void		  allow_write_access(struct inode *);
 
 // ramdisk.c
 void ramdiskinit(void);
@@ -85,8 +98,10 @@ void ramdiskrw(struct buf *);
 
 // kalloc.c
 void *kalloc(void);
+void *kzalloc(void);
 void  kfree(void *);
-void  kinit(void);
+void  kdup(void *);
+int	  kshared(void *);
 
 // log.c
 void initlog(int, struct superblock *);
@@ -95,6 +110,7 @@ void begin_op(void);
 void end_op(void);
 
 // pipe.c
+void pipeinit(void);
 int	 pipealloc(struct file **, struct file **);
 void pipeclose(struct pipe *, int);
 int	 piperead(struct pipe *, uint64_t, int);
@@ -117,7 +133,6 @@ int			 cpu_id(void);
 void		 exit(int);
 int			 fork(void);
 int			 growproc(int);
-void		 proc_mapstacks(pagetable_t);
 pagetable_t	 proc_pagetable(struct proc *);
 void		 proc_freepagetable(pagetable_t, uint64_t);
 int			 kill(int);
@@ -125,6 +140,8 @@ int			 killed(struct proc *);
 void		 setkilled(struct proc *);
 struct cpu  *this_cpu(void);
 struct proc *this_proc();
+int			 this_node(void);
+void		 cpu_idle(void);
 void		 procinit(void);
 void		 scheduler(void) __attribute__((noreturn));
 void		 sched(void);
@@ -136,6 +153,7 @@ void		 yield(void);
 int	 either_copyout(int user_dst, uint64_t dst, void *src, uint64_t len);
 int	 either_copyin(void *dst, int user_src, uint64_t src, uint64_t len);
 void procdump(void);
+void wakeup_bench(void);
 
 // swtch.S
 void swtch(struct context *, struct context *);
@@ -144,10 +162,21 @@ void swtch(struct context *, struct context *);
 int	  memcmp(const void *, const void *, uint);
 void *memmove(void *, const void *, uint);
 void *memset(void *, int, uint);
+int	  memcmp_word(const void *, const void *, uint);
+void *memmove_word(void *, const void *, uint);
+void *memset_word(void *, int, uint);
 char *safestrcpy(char *, const char *, int);
 int	  strlen(const char *);
 int	  strncmp(const char *, const char *, uint);
 char *strncpy(char *, const char *, int);
+void  string_init(void);
+void  string_init_hart(void);
+void  string_bench(void);
+
+// string_rvv.S
+int	  memcmp_rvv(const void *, const void *, uint);
+void *memcpy_rvv(void *, const void *, uint);
+void *memset_rvv(void *, int, uint);
 
 // syscall.c
 void argint(int, int *);
@@ -158,7 +187,7 @@ int	 fetchaddr(uint64_t, uint64_t *);
 void syscall();
 
 // trap.c
-extern uint			   ticks;
+extern uint64_t		   ticks;
 void				   trapinit(void);
 void				   trapinithart(void);
 extern struct spinlock tickslock;
@@ -172,6 +201,11 @@ void uartputc_sync(int);
 int	 uartgetc(void);
 
 // vm.c
+// Access that caused a page fault, see uvmfault().
+#define FAULT_READ 0
+#define FAULT_WRITE 1
+#define FAULT_EXEC 2
+
 void		kern_vm_init(void);
 void		kvm_init_hart(void);
 void		kvmmap(pagetable_t, uint64_t, uint64_t, uint64_t, int);
@@ -181,6 +215,10 @@ void		uvmfirst(pagetable_t, uchar *, uint);
 uint64_t	uvmalloc(pagetable_t, uint64_t, uint64_t, int);
 uint64_t	uvmdealloc(pagetable_t, uint64_t, uint64_t);
 int			uvmcopy(pagetable_t, pagetable_t, uint64_t);
+int			uvmcopy_range(pagetable_t, pagetable_t, uint64_t, uint64_t, int);
+int			uvmcow(pagetable_t, uint64_t);
+int			uvmfault(struct proc *, uint64_t, int);
+void		uvmprefault(struct proc *, uint64_t, uint64_t);
 void		uvmfree(pagetable_t, uint64_t);
 void		uvmunmap(pagetable_t, uint64_t, uint64_t, int);
 void		uvmclear(pagetable_t, uint64_t);
@@ -190,6 +228,26 @@ int			copyout(pagetable_t, uint64_t, char *, uint64_t);
 int			copyin(pagetable_t, char *, uint64_t, uint64_t);
 int			copyinstr(pagetable_t, char *, uint64_t, uint64_t);
 
+// mmap.c
+void		mmapinit(void);
+uint64_t	mmap(uint64_t, uint64_t, int, int, struct file *, uint64_t);
+int			munmap(uint64_t, uint64_t);
+struct vma *vma_find(struct proc *, uint64_t);
+uint64_t	vma_lowest(struct proc *);
+int			vma_fault(struct proc *, struct vma *, uint64_t, int);
+int			vma_copy(struct proc *, struct proc *);
+void		vma_unmap_all(struct proc *);
+
+// tlb.c
+void	 asid_init(void);
+void	 asid_release(struct proc *);
+uint64_t proc_satp(struct proc *);
+void	 tlb_batch_init(struct tlb_batch *, struct proc *);
+void	 tlb_batch_add(struct tlb_batch *, uint64_t, uint64_t);
+void	 tlb_batch_flush(struct tlb_batch *);
+void	 flush_tlb_range(struct proc *, uint64_t, uint64_t);
+void	 flush_tlb_page(struct proc *, uint64_t);
+
 // plic.c
 void plicinit(void);
 void plicinithart(void);
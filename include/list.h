@@ -2,6 +2,7 @@
 #ifndef __LIST_H_
 #define __LIST_H_
 
+#include "sbi/sbi_types.h" // container_of
 #include "types.h"
 
 struct list_head {
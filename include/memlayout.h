@@ -79,10 +79,6 @@
 // in both user and kernel space.
 #define TRAMPOLINE (MAX_VA - PGSIZE)
 
-// map kernel stacks beneath the trampoline,
-// each surrounded by invalid guard pages.
-#define KSTACK(p) (TRAMPOLINE - ((p) + 1) * 2 * PGSIZE)
-
 // User memory layout.
 // Address zero first:
 //   text
@@ -90,8 +86,10 @@
 //   fixed-size stack
 //   expandable heap
 //   ...
+//   mmap() mappings, placed top down
 //   TRAPFRAME (p->trapframe, used by the trampoline)
 //   TRAMPOLINE (the same page as in the kernel)
 #define TRAPFRAME (TRAMPOLINE - PGSIZE)
+#define MMAP_TOP TRAPFRAME
 
 #endif // __MEM_LAYOUT_H_
@@ -1,16 +1,60 @@
 #ifndef __MM_H_
 #define __MM_H_
 
+#include "device_tree.h"
+#include "list.h"
 #include "riscv.h"
 #include "types.h"
 
 #define pa_to_pfn(pa) ((pa) >> PGSHIFT)
 #define pfn_to_pa(pfn) ((pfn) << PGSHIFT)
 
+// the buddy system keeps free blocks of 2^0 ~ 2^MAX_ORDER pages.
+#define MAX_ORDER 10
+
+// page flags
+#define PG_reserved (1U << 0) // never handed to the buddy system
+#define PG_buddy (1U << 1)	  // head of a free block in a buddy free list
+#define PG_slab (1U << 2)	  // owned by a slab of kmem_cache
+#define PG_pcp (1U << 3)	  // cached in a per-cpu page list
+#define PG_zeroed (1U << 4)	  // zeroed, in the zero pool of its node
+
+// page allocation flags
+#define __GFP_ZERO (1U << 0) // return zeroed pages
+
+// byte patterns of poisoned pages, with CONFIG_PAGE_POISON
+#define PAGE_POISON_FREE 0x01  // written on free, catches dangling refs
+#define PAGE_POISON_ALLOC 0x05 // written on alloc, catches missing init
+
+// Per page frame metadata, one for each physical page of a numa node.
+struct page {
+	struct list_head list;	// buddy free/per-cpu/zero pool/text page list
+	uint32_t		 flags; // PG_xxx
+	uint32_t		 order; // order of the free block, valid if PG_buddy
+	void			*slab;	// slab the page belongs to, valid if PG_slab
+	int				 refcount; // holders of an allocated page, see kdup()
+	uint64_t		 index;	 // file offset of a cached text page
+};
+
+// Per numa node page allocation stats, in pages.
+struct numa_stat {
+	uint64_t hit;	  // meant for this node and served by it
+	uint64_t miss;	  // meant for another node but served by this one
+	uint64_t foreign; // meant for this node but served by another one
+};
+
+// nodes with memory, nearest first, for allocations meant for node nid.
+extern int node_fallback[MAX_NUMA_NODE][MAX_NUMA_NODE];
+extern int nr_fallback_nodes;
+
+#define for_each_fallback_node(nid, i, fb) \
+	for (i = 0; i < nr_fallback_nodes && (fb = node_fallback[nid][i], 1); i++)
+
 /* clang-format off */
 
 // physical pages allocator APIs
 extern void* (* alloc_pages)(uint32_t npages);
+extern void* (* alloc_pages_node)(int nid, uint32_t npages);
 extern void* (* alloc_zero_pages)(uint32_t npages);
 extern void  (* free_pages)(void* addr, uint32_t npages);
 
@@ -20,11 +64,35 @@ extern void  (* free_pages)(void* addr, uint32_t npages);
 #define free_pages_exact(addr, size) \
     free_pages((addr), ((size) + PGSIZE - 1) >> PGSHIFT)
 
+// numa APIs
+void				numa_init(void);
+int					node_distance(int from, int to);
+void				numa_stat_account(int nid, int served, uint32_t npages);
+struct numa_stat*	numa_stat_of(int nid);
+void				numa_info(void);
+
 // bootmem APIs
 int		bootmem_init(void);
 void*	bootmem_alloc(uint32_t npages);
+void*	bootmem_alloc_node(int nid, uint32_t npages);
 void*	bootmem_alloc_zeros(uint32_t npages);
 void	bootmem_free(void* addr, uint32_t npages);
+void	bootmem_free_all(void (*free_range)(uint64_t pfn, uint64_t npages));
+
+// buddy system APIs
+int				buddy_init(void);
+void*			buddy_alloc(uint32_t npages);
+void*			buddy_alloc_node(int nid, uint32_t npages);
+void*			buddy_alloc_zeros(uint32_t npages);
+void			buddy_free(void* addr, uint32_t npages);
+void			buddy_info(void);
+int				zero_pool_refill(void);
+int				pfn_to_nid(uint64_t pfn);
+struct page*	pfn_to_page(uint64_t pfn);
+uint64_t		page_to_pfn(struct page* page);
+
+#define virt_to_page(addr) pfn_to_page(pa_to_pfn((uint64_t)(addr)))
+#define page_to_virt(page) ((void *)pfn_to_pa(page_to_pfn(page)))
 
 /* clang-format on */
 
@@ -1,13 +1,11 @@
 #ifndef __PARAM_H_
 #define __PARAM_H_
 
-#define NPROC 64				   // maximum number of processes
 #define NOFILE 16				   // open files per process
-#define NFILE 100				   // open files per system
-#define NINODE 50				   // maximum number of active i-nodes
 #define NDEV 10					   // maximum major device number
 #define ROOTDEV 1				   // device number of file system root disk
 #define MAXARG 32				   // max exec arguments
+#define NSEG 8					   // max loadable segments of a program
 #define MAXOPBLOCKS 10			   // max # of blocks any FS op writes
 #define LOGSIZE (MAXOPBLOCKS * 3)  // max data blocks in on-disk log
 #define NBUF (MAXOPBLOCKS * 3)	   // size of disk block cache
@@ -4,6 +4,7 @@
 #include "cpu.h"
 #include "device_tree.h"
 #include "file.h"
+#include "list.h"
 #include "param.h"
 #include "riscv.h"
 #include "spinlock.h"
@@ -63,9 +64,38 @@ struct trapframe {
 
 enum procstate { UNUSED, USED, SLEEPING, RUNNABLE, RUNNING, ZOMBIE };
 
+// A loadable segment of the program, paged in from the file on fault.
+struct exec_seg {
+	uint64_t vaddr;	 // page aligned
+	uint64_t memsz;	 // bytes in memory, past filesz is zero filled
+	uint64_t off;	 // offset in the file
+	uint64_t filesz; // bytes in the file
+	int		 perm;	 // PTE_W/PTE_X
+};
+
+// A mapping made by mmap(), its pages are faulted in by vma_fault().
+struct vma {
+	struct list_head list;	// in p->vmas, sorted by address
+	uint64_t		 start; // page aligned
+	uint64_t		 end;	// page aligned, exclusive
+	int				 perm;	// PTE_R/W/X, 0 for PROT_NONE
+	int				 flags; // MAP_SHARED or MAP_PRIVATE, MAP_ANONYMOUS
+	struct file		*file;	// mapped file, 0 if anonymous
+	uint64_t		 off;	// offset of start in the file
+};
+
+// Pages of a process whose PTEs changed, to be flushed from the
+// TLBs at once by tlb_batch_flush().
+struct tlb_batch {
+	struct proc *p;
+	uint64_t	 start; // page aligned
+	uint64_t	 end;	// page aligned, exclusive
+};
+
 // Per-process state
 struct proc {
-	struct spinlock lock;
+	struct spinlock	 lock;
+	struct list_head list; // link in proc_list, never unlinked
 
 	// p->lock must be held when using these:
 	enum procstate state;  // Process state
@@ -73,19 +103,39 @@ struct proc {
 	int			   killed; // If non-zero, have been killed
 	int			   xstate; // Exit status to be returned to parent's wait
 	int			   pid;	   // Process ID
+	int			   cpu;	   // Run queue it is on, or cpu it ran on last
+	int			   home_node; // Numa node its memory comes from
+
+	// the run queue lock of p->cpu must be held when using this:
+	struct list_head rq; // link in the run queue, while RUNNABLE
+
+	// the lock of the wait queue bucket of p->chan must be held when using this:
+	struct list_head wait; // link in the wait queue, while SLEEPING
 
 	// wait_lock must be held when using this:
 	struct proc *parent; // Parent process
 
 	// these are private to the process, so p->lock need not be held.
-	uint64_t		  kstack;		 // Virtual address of kernel stack
+	uint64_t		  kstack;		 // Kernel stack page, direct mapped
 	uint64_t		  sz;			 // Size of process memory (bytes)
+	uint64_t		  min_flt;		 // Page faults served without I/O
 	pagetable_t		  pagetable;	 // User page table
+	uint64_t		  asid;			 // ASID and its generation, see tlb.c
+	uint64_t		  tlb_cpus;		 // Harts which ran it with this ASID
 	struct trapframe *trapframe;	 // data page for trampoline.S
 	struct context	  context;		 // swtch() here to run process
 	struct file		*ofile[NOFILE]; // Open files
 	struct inode	 *cwd;			 // Current directory
+	struct inode	 *exec_ip;		 // Program file the segments page in from
+	int				  nseg;			 // Number of segments
+	struct exec_seg	  seg[NSEG];	 // Loadable segments of the program
+	struct list_head  vmas;			 // mmap() mappings
 	char			  name[16];		 // Process name (debugging)
 };
 
+// Procs are allocated on demand and recycled through UNUSED but never
+// freed, so proc_list can be walked without holding any lock.
+extern struct list_head proc_list;
+#define for_each_proc(p) list_for_each_entry(p, &proc_list, list)
+
 #endif // __PROC_H_
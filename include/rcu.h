@@ -0,0 +1,60 @@
+#ifndef __RCU_H_
+#define __RCU_H_
+
+#include "list.h"
+#include "spinlock.h"
+#include "types.h"
+
+// Read-copy-update, see kernel/rcu.c.
+
+// Callback of call_rcu(), usually embedded in the object it frees.
+struct rcu_head {
+	struct rcu_head *next;
+	void (*fn)(struct rcu_head *);
+};
+
+// A read section keeps interrupts, and so preemption, off: it must
+// not sleep. Objects found in it stay valid until rcu_read_unlock().
+static inline void rcu_read_lock(void) { push_off(); }
+static inline void rcu_read_unlock(void) { pop_off(); }
+
+// Load a pointer published with rcu_assign_pointer(), so the loads
+// through it see the object as it was initialized.
+#define rcu_dereference(p) __atomic_load_n(&(p), __ATOMIC_ACQUIRE)
+// Publish p after the stores that initialized the object it points to.
+#define rcu_assign_pointer(p, v) __atomic_store_n(&(p), (v), __ATOMIC_RELEASE)
+
+// Lists whose readers walk them in read sections, while the writers
+// serialize with a lock of their own.
+
+static inline void list_add_rcu(struct list_head *list, struct list_head *head) {
+	list->next = head->next;
+	list->prev = head;
+	rcu_assign_pointer(head->next, list);
+	list->next->prev = list;
+}
+
+// Unlink entry; readers may still be on it, so it keeps its next
+// pointer and must not be freed before a grace period is over.
+static inline void list_del_rcu(struct list_head *entry) {
+	entry->next->prev = entry->prev;
+	rcu_assign_pointer(entry->prev->next, entry->next);
+	entry->prev = LIST_POISON2;
+}
+
+#define list_for_each_entry_rcu(pos, head, member)                        \
+	for (pos = list_entry(rcu_dereference((head)->next), typeof(*pos),   \
+						  member);                                       \
+		 &pos->member != (head);                                         \
+		 pos = list_entry(rcu_dereference(pos->member.next), typeof(*pos), \
+						  member))
+
+// rcu.c
+void rcuinit(void);
+void rcu_qs(void);
+void rcu_idle_enter(void);
+void rcu_idle_exit(void);
+void call_rcu(struct rcu_head *head, void (*fn)(struct rcu_head *));
+void synchronize_rcu(void);
+
+#endif // __RCU_H_
@@ -90,6 +90,8 @@ static inline void w_mepc(uint64_t x) {
 
 // Supervisor Status Register, sstatus
 
+#define SSTATUS_VS (3L << 9)    // Vector unit status, 0=Off
+#define SSTATUS_VS_INITIAL (1L << 9)
 #define SSTATUS_SPP (1L << 8)   // Previous mode, 1=Supervisor, 0=User
 #define SSTATUS_SPIE (1L << 5)  // Supervisor Previous Interrupt Enable
 #define SSTATUS_UPIE (1L << 4)  // User Previous Interrupt Enable
@@ -117,6 +119,8 @@ static inline void w_sip(uint64_t x) {
     asm volatile("csrw sip, %0" : : "r"(x));
 }
 
+#define SIP_SSIP (1L << 1) // software interrupt pending
+
 // Supervisor Interrupt Enable
 
 /**
@@ -313,11 +317,6 @@ static inline void w_pmpaddr0(uint64_t x) {
     asm volatile("csrw pmpaddr0, %0" : : "r"(x));
 }
 
-// use riscv's sv39 page table scheme.
-#define SATP_SV39 (8L << 60)
-
-#define MAKE_SATP(pagetable) (SATP_SV39 | (((uint64_t)pagetable) >> 12))
-
 // supervisor address translation and protection;
 // holds the address of the page table.
 
@@ -426,6 +425,13 @@ static inline uint64_t r_time() {
     return x;
 }
 
+// cycle counter, readable in S-mode if SBI sets mcounteren.CY
+static inline uint64_t r_cycle() {
+    uint64_t x;
+    asm volatile("csrr %0, cycle" : "=r"(x));
+    return x;
+}
+
 // enable device interrupts
 static inline void intr_on() {
     w_sstatus(r_sstatus() | SSTATUS_SIE);
@@ -436,6 +442,12 @@ static inline void intr_off() {
     w_sstatus(r_sstatus() & ~SSTATUS_SIE);
 }
 
+// wait for an interrupt, wakes up on interrupts enabled in sie
+// even if interrupts are disabled.
+static inline void wfi() {
+    asm volatile("wfi");
+}
+
 // are device interrupts enabled?
 static inline int intr_get() {
     uint64_t x = r_sstatus();
@@ -472,11 +484,40 @@ static inline void sfence_vma() {
     asm volatile("sfence.vma zero, zero");
 }
 
+// flush the TLB entries of one address space.
+static inline void sfence_vma_asid(uint64_t asid) {
+    asm volatile("sfence.vma zero, %0" : : "r"(asid) : "memory");
+}
+
+// flush the TLB entries of one page of one address space.
+static inline void sfence_vma_page(uint64_t va, uint64_t asid) {
+    asm volatile("sfence.vma %0, %1" : : "r"(va), "r"(asid) : "memory");
+}
+
 typedef uint64_t pte_t;
 typedef uint64_t* pagetable_t;  // 512 PTEs
 
 #endif  // __ASSEMBLER__
 
+// satp mode of the page table scheme we build with.
+#ifdef __RISCV_SV39__
+#define SATP_MODE (8L << 60)
+#endif
+#ifdef __RISCV_SV48__
+#define SATP_MODE (9L << 60)
+#endif
+#ifdef __RISCV_SV57__
+#define SATP_MODE (10L << 60)
+#endif
+
+#define SATP_ASID_SHIFT 44
+#define SATP_ASID_MASK (0xFFFFL << SATP_ASID_SHIFT)
+
+#define MAKE_SATP_ASID(pagetable, asid)                     \
+	(SATP_MODE | ((uint64_t)(asid) << SATP_ASID_SHIFT) | \
+	 (((uint64_t)pagetable) >> 12))
+#define MAKE_SATP(pagetable) MAKE_SATP_ASID(pagetable, 0)
+
 #define PGSIZE 4096  // bytes per page
 #define PGSHIFT 12   // bits of offset within a page
 
@@ -488,6 +529,9 @@ typedef uint64_t* pagetable_t;  // 512 PTEs
 #define PTE_W (1L << 2)
 #define PTE_X (1L << 3)
 #define PTE_U (1L << 4)  // user can access
+#define PTE_A (1L << 6)  // accessed, set by the hardware
+#define PTE_D (1L << 7)  // dirty, set by the hardware
+#define PTE_COW (1L << 8) // copy-on-write, uses one of the RSW bits
 
 // shift a physical address to the right place for a PTE.
 #define PA2PTE(pa) ((((uint64_t)pa) >> 12) << 10)
@@ -496,11 +540,33 @@ typedef uint64_t* pagetable_t;  // 512 PTEs
 
 #define PTE_FLAGS(pte) ((pte)&0x3FF)
 
+// a valid PTE with any of R/W/X is a leaf, otherwise it points to
+// the next level page table.
+#define PTE_LEAF(pte) ((pte) & (PTE_R | PTE_W | PTE_X))
+
 // extract the three 9-bit page table indices from a virtual address.
 #define PXMASK 0x1FF  // 9 bits
 #define PXSHIFT(level) (PGSHIFT + (9 * (level)))
 #define PX(level, va) ((((uint64_t)(va)) >> PXSHIFT(level)) & PXMASK)
 
+// bytes mapped by a leaf PTE of the level: 4K, 2M (megapage), 1G (gigapage).
+#define PXSIZE(level) (1UL << PXSHIFT(level))
+#define MAX_LEAF_LEVEL 2 // highest level mappages() puts leaves at
+
+// level of the root page table.
+#ifdef __RISCV_SV32__
+#define PT_TOP_LEVEL 1
+#endif
+#ifdef __RISCV_SV39__
+#define PT_TOP_LEVEL 2
+#endif
+#ifdef __RISCV_SV48__
+#define PT_TOP_LEVEL 3
+#endif
+#ifdef __RISCV_SV57__
+#define PT_TOP_LEVEL 4
+#endif
+
 // one beyond the highest possible virtual address.
 // MAXVA is actually one bit less than the max allowed by Sv32/Sv39/Sv48/Sv57, 
 // to avoid having to sign-extend virtual addresses that have the high bit set.
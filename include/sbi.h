@@ -326,6 +326,24 @@ enum sbi_cppc_reg_id {
 		a0;                                                           \
 	})
 
+// for the calls with more than 3 arguments.
+#define SBI_ECALL_5(__eid, __fid, __a0, __a1, __a2, __a3, __a4)      \
+	({                                                                \
+		register unsigned long a0 asm("a0") = (unsigned long)(__a0);  \
+		register unsigned long a1 asm("a1") = (unsigned long)(__a1);  \
+		register unsigned long a2 asm("a2") = (unsigned long)(__a2);  \
+		register unsigned long a3 asm("a3") = (unsigned long)(__a3);  \
+		register unsigned long a4 asm("a4") = (unsigned long)(__a4);  \
+		register unsigned long a6 asm("a6") = (unsigned long)(__fid); \
+		register unsigned long a7 asm("a7") = (unsigned long)(__eid); \
+		asm volatile("ecall"                                          \
+					 : "+r"(a0)                                       \
+					 : "r"(a1), "r"(a2), "r"(a3), "r"(a4), "r"(a6),   \
+					   "r"(a7)                                        \
+					 : "memory");                                     \
+		a0;                                                           \
+	})
+
 #define SBI_ECALL_0(__eid, __fid) SBI_ECALL(__eid, __fid, 0, 0, 0)
 #define SBI_ECALL_1(__eid, __fid, __a0) SBI_ECALL(__eid, __fid, __a0, 0, 0)
 #define SBI_ECALL_2(__eid, __fid, __a0, __a1) \
@@ -346,4 +364,10 @@ enum sbi_cppc_reg_id {
 #define sbi_ecall_hart_start(h, a, m) \
 	SBI_ECALL_3(SBI_EXT_HSM, SBI_EXT_HSM_HART_START, (h), (a), (m))
 
+// sfence.vma of [start, start + size) of address space asid on the
+// harts in mask; size -1 flushes the whole address space.
+#define sbi_ecall_remote_sfence_vma_asid(m, start, size, asid)                \
+	SBI_ECALL_5(SBI_EXT_RFENCE, SBI_EXT_RFENCE_REMOTE_SFENCE_VMA_ASID, (m), \
+				0, (start), (size), (asid))
+
 #endif // _ASM_RISCV_SBI_H_
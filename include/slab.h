@@ -0,0 +1,52 @@
+#ifndef __SLAB_H_
+#define __SLAB_H_
+
+#include "device_tree.h"
+#include "list.h"
+#include "spinlock.h"
+#include "types.h"
+
+#define SLAB_MAGAZINE_SIZE 16 // objects cached by each cpu of a cache
+#define SLAB_BATCH (SLAB_MAGAZINE_SIZE / 2) // objects moved on refill/flush
+
+// per-cpu stack of free objects, accessed with interrupts off only.
+struct magazine {
+	uint32_t avail;
+	void	 *objs[SLAB_MAGAZINE_SIZE];
+};
+
+// slabs of a cache which come from one numa node.
+struct kmem_cache_node {
+	struct spinlock	 lock;
+	struct list_head partial; // slabs with both used and free objects
+	struct list_head full;	  // slabs without free objects
+	struct list_head free;	  // slabs without used objects
+	uint32_t		 nr_free; // number of slabs on the free list
+	uint32_t		 nr_slabs;
+};
+
+struct kmem_cache {
+	char			*name;
+	uint32_t		 size;	  // object size, including alignment
+	uint32_t		 order;	  // every slab takes 2^order pages
+	uint32_t		 offset;  // offset of the first object in a slab
+	uint32_t		 nr_objs; // number of objects per slab
+	struct list_head list;	  // link of all caches
+
+	struct magazine		   cpu_cache[MAX_CPU];
+	struct kmem_cache_node nodes[MAX_NUMA_NODE];
+};
+
+/* clang-format off */
+
+// slab.c
+void				kmem_cache_init(void);
+struct kmem_cache*	kmem_cache_create(char* name, uint32_t size, uint32_t align);
+void*				kmem_cache_alloc(struct kmem_cache* cachep);
+void*				kmem_cache_zalloc(struct kmem_cache* cachep);
+void				kmem_cache_free(struct kmem_cache* cachep, void* objp);
+void				kmem_cache_info(void);
+
+/* clang-format on */
+
+#endif // __SLAB_H_
@@ -3,16 +3,22 @@
 
 #include "spinlock.h"
 
-// Long-term locks for processes
+struct proc;
+
+// Long-term locks for processes. Waiters spin while the holder runs
+// on another cpu, and sleep once it is off cpu.
 struct sleeplock {
-	uint			locked; // Is the lock held?
-	struct spinlock lk;		// spinlock protecting this sleep lock
+	uint			locked; // 0 free, SLEEPLOCK_HELD, or SLEEPLOCK_WAITERS
+	struct spinlock lk;		// serializes sleepers with release_sleep()
+	struct proc	   *owner;	// Process holding lock, if any
 
 	// For debugging:
 	char *name; // Name of lock.
-	int	  pid;	// Process holding lock
 };
 
+#define SLEEPLOCK_HELD 1
+#define SLEEPLOCK_WAITERS 2 // held, and there may be sleepers to wake
+
 // sleeplock.c
 void acquire_sleep(struct sleeplock *);
 void release_sleep(struct sleeplock *);
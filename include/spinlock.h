@@ -1,18 +1,41 @@
 #ifndef __SPINLOCK_H_
 #define __SPINLOCK_H_
 
-#include "cpu.h"
 #include "types.h"
 
-// Mutual exclusion lock.
+struct cpu;
+
+// Mutual exclusion lock, a ticket lock: cpus get the lock in the
+// order they asked for it, and wait with plain loads of owner
+// instead of atomic swaps on the line of the lock.
 struct spinlock {
-	uint locked; // Is the lock held?
+	uint next;	// Next ticket to hand out.
+	uint owner; // Ticket of the holder, the lock is free if owner == next.
 
 	// For debugging:
 	char		 *name; // Name of lock.
 	struct cpu *cpu;  // The cpu holding the lock.
+#ifdef CONFIG_LOCK_STAT
+	uint class; // lockstat entry of name
+#endif
 };
 
+// Reader-writer spin lock, for data that is mostly read: any number
+// of readers, or one writer. A waiting writer keeps new readers out,
+// so a reader must not take a read lock it already holds.
+typedef struct {
+	uint  cnt;	// readers holding the lock, and the RW_ bits
+	char *name; // Name of lock.
+} rwlock_t;
+
+// Sequence lock, for small data that is read often and written
+// rarely. Readers take no lock at all: they retry if a writer
+// was active while they read, see read_seqbegin().
+typedef struct {
+	uint			seq;  // odd while a writer is active
+	struct spinlock lock; // serializes the writers
+} seqlock_t;
+
 // spinlock.c
 void acquire(struct spinlock *);
 int	 holding(struct spinlock *);
@@ -20,5 +43,34 @@ void initlock(struct spinlock *, char *);
 void release(struct spinlock *);
 void push_off(void);
 void pop_off(void);
+void lockstat_dump(void);
+void rwlock_init(rwlock_t *, char *);
+void read_lock(rwlock_t *);
+void read_unlock(rwlock_t *);
+void write_lock(rwlock_t *);
+void write_unlock(rwlock_t *);
+void seqlock_init(seqlock_t *, char *);
+void write_seqlock(seqlock_t *);
+void write_sequnlock(seqlock_t *);
+
+// Start a lockless read of the data of sl, e.g.
+//	do {
+//		seq = read_seqbegin(&sl);
+//		... copy the data ...
+//	} while (read_seqretry(&sl, seq));
+static inline uint read_seqbegin(seqlock_t *sl) {
+	uint seq;
+
+	while ((seq = __atomic_load_n(&sl->seq, __ATOMIC_ACQUIRE)) & 1)
+		;
+	return seq;
+}
+
+// Whether the data read since read_seqbegin() returned seq
+// may be torn by a writer, so the read must be retried.
+static inline int read_seqretry(seqlock_t *sl, uint seq) {
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	return __atomic_load_n(&sl->seq, __ATOMIC_RELAXED) != seq;
+}
 
 #endif // __SPINLOCK_H_
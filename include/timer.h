@@ -1,14 +1,49 @@
 #ifndef __TIMER_H_
 #define __TIMER_H_
 
-#include "types.h"
+#include "list.h"
 #include "spinlock.h"
+#include "types.h"
 
 extern struct spinlock tickslock;
-extern uint			   ticks;
+extern uint64_t		   ticks;
+
+// A timer of the timer wheel, which calls fn in interrupt context
+// once the tick count reaches expires. Timers fire on the cpu they
+// were added on. Callers serialize add/mod/del_timer of one timer.
+struct timer_list {
+	struct list_head entry; // link in a slot of the wheel, while pending
+	uint64_t		 expires;
+	void (*fn)(struct timer_list *);
+	struct timer_base *base; // base it is pending on, or was last
+	uint32_t		   slot; // level * WHEEL_SIZE + slot it is pending in
+};
+
+// A high resolution timer, which calls fn in interrupt context once
+// r_time() reaches expires. Fires on the cpu it was started on.
+struct hrtimer {
+	struct list_head entry; // link in the sorted list of the cpu, while pending
+	uint64_t		 expires;
+	void (*fn)(struct hrtimer *);
+	struct hrtimer_base *base;
+};
+
+void	 timerinit();
+void	 ticks_sync(void);
+uint64_t ticks_read(void);
+void	 set_next_timeout();
+int		 timer_tick();
+
+void init_timer(struct timer_list *t, void (*fn)(struct timer_list *));
+void add_timer(struct timer_list *t);
+int	 del_timer(struct timer_list *t);
+int	 mod_timer(struct timer_list *t, uint64_t expires);
+int	 timer_pending(struct timer_list *t);
+
+void hrtimer_init(struct hrtimer *t, void (*fn)(struct hrtimer *));
+void hrtimer_start(struct hrtimer *t, uint64_t expires);
+int	 hrtimer_cancel(struct hrtimer *t);
 
-void timerinit();
-void set_next_timeout();
-void timer_tick();
+void timer_start_slice(void);
 
 #endif // __TIMER_H_
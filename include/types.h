@@ -15,4 +15,6 @@ typedef uint64_t	  pde_t;
 
 typedef unsigned long size_t;
 
+typedef unsigned int gfp_t; // page allocation flags, __GFP_xxx
+
 #endif
@@ -1,6 +1,6 @@
 // Buffer cache.
 //
-// The buffer cache is a linked list of buf structures holding
+// The buffer cache is a hash table of buf structures holding
 // cached copies of disk block contents.  Caching disk blocks
 // in memory reduces the number of disk reads and also provides
 // a synchronization point for disk blocks used by multiple processes.
@@ -22,65 +22,151 @@
 #include "spinlock.h"
 #include "types.h"
 
-struct {
+// The cache is split into NBUCKET buckets by (dev, blockno), each
+// with its own lock and LRU list, so lookups of blocks in different
+// buckets share no lock. A bucket lock protects the list of the
+// bucket and dev, blockno and refcnt of its buffers. A miss recycles
+// the LRU unused buffer of its bucket, or else steals one from
+// another bucket. No one holds two bucket locks at once.
+#define NBUCKET 13
+
+struct bucket {
 	struct spinlock lock;
-	struct buf		buf[NBUF];
 
-	// Linked list of all buffers, through prev/next.
+	// Linked list of the buffers of the bucket, through prev/next.
 	// Sorted by how recently the buffer was used.
 	// head.next is most recent, head.prev is least.
 	struct buf head;
+};
+
+struct {
+	struct buf	  buf[NBUF];
+	struct bucket bucket[NBUCKET];
 } bcache;
 
-void binit(void) {
-	struct buf *b;
+static inline struct bucket *bucket_of(uint dev, uint blockno) {
+	return &bcache.bucket[(dev * 31 + blockno) % NBUCKET];
+}
 
-	initlock(&bcache.lock, "bcache");
+static inline void buf_unlink(struct buf *b) {
+	b->next->prev = b->prev;
+	b->prev->next = b->next;
+}
+
+// Insert b as the most recently used buffer of bk.
+static inline void buf_link(struct bucket *bk, struct buf *b) {
+	b->next				= bk->head.next;
+	b->prev				= &bk->head;
+	bk->head.next->prev = b;
+	bk->head.next		= b;
+}
 
-	// Create linked list of buffers
-	bcache.head.prev = &bcache.head;
-	bcache.head.next = &bcache.head;
+void binit(void) {
+	struct bucket *bk;
+	struct buf	   *b;
+
+	for (bk = bcache.bucket; bk < bcache.bucket + NBUCKET; bk++) {
+		initlock(&bk->lock, "bcache.bucket");
+		bk->head.prev = &bk->head;
+		bk->head.next = &bk->head;
+	}
+	// Deal the buffers out to the buckets.
 	for (b = bcache.buf; b < bcache.buf + NBUF; b++) {
-		b->next = bcache.head.next;
-		b->prev = &bcache.head;
 		init_sleeplock(&b->lock, "buffer");
-		bcache.head.next->prev = b;
-		bcache.head.next	   = b;
+		buf_link(&bcache.bucket[(b - bcache.buf) % NBUCKET], b);
 	}
 }
 
-// Look through buffer cache for block on device dev.
-// If not found, allocate a buffer.
-// In either case, return locked buffer.
-static struct buf *bget(uint dev, uint blockno) {
+// The cached buffer of the block in bk, with a ref taken,
+// or 0. Caller must hold bk->lock.
+static struct buf *bucket_find(struct bucket *bk, uint dev, uint blockno) {
 	struct buf *b;
 
-	acquire(&bcache.lock);
-
-	// Is the block already cached?
-	for (b = bcache.head.next; b != &bcache.head; b = b->next) {
+	for (b = bk->head.next; b != &bk->head; b = b->next) {
 		if (b->dev == dev && b->blockno == blockno) {
 			b->refcnt++;
-			release(&bcache.lock);
-			acquire_sleep(&b->lock);
 			return b;
 		}
 	}
+	return 0;
+}
 
-	// Not cached.
-	// Recycle the least recently used (LRU) unused buffer.
-	for (b = bcache.head.prev; b != &bcache.head; b = b->prev) {
-		if (b->refcnt == 0) {
-			b->dev	   = dev;
-			b->blockno = blockno;
-			b->valid   = 0;
-			b->refcnt  = 1;
-			release(&bcache.lock);
-			acquire_sleep(&b->lock);
+// The least recently used unused buffer of bk, or 0.
+// Caller must hold bk->lock.
+static struct buf *bucket_lru(struct bucket *bk) {
+	struct buf *b;
+
+	for (b = bk->head.prev; b != &bk->head; b = b->prev)
+		if (b->refcnt == 0)
+			return b;
+	return 0;
+}
+
+// Take an unused buffer out of a bucket other than bk, trying the
+// next buckets first.
+static struct buf *bucket_steal(struct bucket *bk) {
+	struct bucket *victim;
+	struct buf	   *b;
+	int			   i = bk - bcache.bucket;
+
+	for (int k = 1; k < NBUCKET; k++) {
+		victim = &bcache.bucket[(i + k) % NBUCKET];
+		acquire(&victim->lock);
+		if ((b = bucket_lru(victim)) != 0) {
+			buf_unlink(b);
+			release(&victim->lock);
 			return b;
 		}
+		release(&victim->lock);
+	}
+	return 0;
+}
+
+static inline void buf_recycle(struct buf *b, uint dev, uint blockno) {
+	b->dev	   = dev;
+	b->blockno = blockno;
+	b->valid   = 0;
+	b->refcnt  = 1;
+}
+
+// Look through buffer cache for block on device dev.
+// If not found, allocate a buffer.
+// In either case, return locked buffer.
+static struct buf *bget(uint dev, uint blockno) {
+	struct bucket *bk = bucket_of(dev, blockno);
+	struct buf	   *b, *stolen;
+
+	acquire(&bk->lock);
+
+	// Is the block already cached?
+	if ((b = bucket_find(bk, dev, blockno)) != 0)
+		goto found;
+
+	// Not cached.
+	// Recycle the least recently used (LRU) unused buffer.
+	if ((b = bucket_lru(bk)) != 0) {
+		buf_recycle(b, dev, blockno);
+		goto found;
+	}
+	release(&bk->lock);
+
+	// None in this bucket, move one over from another.
+	if ((stolen = bucket_steal(bk)) == 0)
+		panic("bget: no buffers");
+
+	// Look again, the block may have been cached meanwhile; the
+	// stolen buffer then stays here as an unused one.
+	acquire(&bk->lock);
+	buf_link(bk, stolen);
+	if ((b = bucket_find(bk, dev, blockno)) == 0) {
+		b = stolen;
+		buf_recycle(b, dev, blockno);
 	}
-	panic("bget: no buffers");
+
+found:
+	release(&bk->lock);
+	acquire_sleep(&b->lock);
+	return b;
 }
 
 // Return a locked buf with the contents of the indicated block.
@@ -103,36 +189,39 @@ void bwrite(struct buf *b) {
 }
 
 // Release a locked buffer.
-// Move to the head of the most-recently-used list.
+// Move to the head of the most-recently-used list of its bucket.
 void brelse(struct buf *b) {
+	struct bucket *bk;
+
 	if (!holding_sleep(&b->lock))
 		panic("brelse");
 
 	release_sleep(&b->lock);
 
-	acquire(&bcache.lock);
+	// b cannot change buckets while we hold a ref.
+	bk = bucket_of(b->dev, b->blockno);
+	acquire(&bk->lock);
 	b->refcnt--;
 	if (b->refcnt == 0) {
 		// no one is waiting for it.
-		b->next->prev		   = b->prev;
-		b->prev->next		   = b->next;
-		b->next				   = bcache.head.next;
-		b->prev				   = &bcache.head;
-		bcache.head.next->prev = b;
-		bcache.head.next	   = b;
+		buf_unlink(b);
+		buf_link(bk, b);
 	}
-
-	release(&bcache.lock);
+	release(&bk->lock);
 }
 
 void bpin(struct buf *b) {
-	acquire(&bcache.lock);
+	struct bucket *bk = bucket_of(b->dev, b->blockno);
+
+	acquire(&bk->lock);
 	b->refcnt++;
-	release(&bcache.lock);
+	release(&bk->lock);
 }
 
 void bunpin(struct buf *b) {
-	acquire(&bcache.lock);
+	struct bucket *bk = bucket_of(b->dev, b->blockno);
+
+	acquire(&bk->lock);
 	b->refcnt--;
-	release(&bcache.lock);
+	release(&bk->lock);
 }
@@ -127,15 +127,15 @@ static int parse_cpu_node(const void *fdt, int node) {
 
 	// 获取"status"属性
 	const char *status = fdt_getprop(fdt, node, PROP_STATUS, NULL);
-	memcpy(cpu->status, status, strlen(status));
+	safestrcpy(cpu->status, status, MAX_INFO_STR_LEN);
 
 	// 获取"riscv,isa"属性
 	const char *riscv_isa = fdt_getprop(fdt, node, PROP_RISCV_ISA, NULL);
-	memcpy(cpu->riscv_isa, riscv_isa, strlen(riscv_isa));
+	safestrcpy(cpu->riscv_isa, riscv_isa, MAX_INFO_STR_LEN);
 
 	// 获取"mmu-type"属性
 	const char *mmu_type = fdt_getprop(fdt, node, PROP_MMU_TYPE, NULL);
-	memcpy(cpu->mmu_type, mmu_type, strlen(mmu_type));
+	safestrcpy(cpu->mmu_type, mmu_type, MAX_INFO_STR_LEN);
 
 	return 0;
 }
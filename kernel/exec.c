@@ -1,5 +1,12 @@
+// Programs are paged in on demand: exec only records the loadable
+// segments of the file, and the page fault handler reads each page
+// when it is first touched. Full pages of read-only segments are
+// shared by everyone running the program, see ipage_get().
+
 #include "kernel.h"
 #include "elf.h"
+#include "file.h"
+#include "math.h"
 #include "memlayout.h"
 #include "param.h"
 #include "proc.h"
@@ -7,8 +14,6 @@
 #include "spinlock.h"
 #include "types.h"
 
-static int loadseg(pde_t *, uint64_t, struct inode *, uint, uint);
-
 int flags2perm(int flags) {
 	int perm = 0;
 	if (flags & 0x1)
@@ -19,14 +24,16 @@ int flags2perm(int flags) {
 }
 
 int exec(char *path, char **argv) {
-	char		  *s, *last;
-	int			   i, off;
-	uint64_t	   argc, sz = 0, sp, ustack[MAXARG], stackbase;
-	struct elfhdr  elf;
-	struct inode	 *ip;
-	struct proghdr ph;
-	pagetable_t	   pagetable = 0, oldpagetable;
-	struct proc	*p		 = this_proc();
+	char			*s, *last;
+	int				 i, off;
+	uint64_t		 argc, sz = 0, sp, ustack[MAXARG], stackbase;
+	struct elfhdr	 elf;
+	struct inode	*ip, *exec_ip = 0;
+	struct proghdr	 ph;
+	struct exec_seg	 seg[NSEG];
+	int				 nseg	   = 0;
+	pagetable_t		 pagetable = 0, oldpagetable;
+	struct proc		*p		   = this_proc();
 
 	begin_op();
 
@@ -46,7 +53,7 @@ int exec(char *path, char **argv) {
 	if ((pagetable = proc_pagetable(p)) == 0)
 		goto bad;
 
-	// Load program into memory.
+	// Record the segments, their pages are read on the first fault.
 	for (i = 0, off = elf.phoff; i < elf.phnum; i++, off += sizeof(ph)) {
 		if (readi(ip, 0, (uint64_t)&ph, off, sizeof(ph)) != sizeof(ph))
 			goto bad;
@@ -58,14 +65,23 @@ int exec(char *path, char **argv) {
 			goto bad;
 		if (ph.vaddr % PGSIZE != 0)
 			goto bad;
-		uint64_t sz1;
-		if ((sz1 = uvmalloc(pagetable, sz, ph.vaddr + ph.memsz,
-							flags2perm(ph.flags))) == 0)
+		// segments must be in ascending order and must not overlap.
+		if (ph.vaddr < sz || ph.vaddr + ph.memsz >= TRAPFRAME)
 			goto bad;
-		sz = sz1;
-		if (loadseg(pagetable, ph.vaddr, ip, ph.off, ph.filesz) < 0)
+		if (nseg == NSEG)
 			goto bad;
+		seg[nseg].vaddr	 = ph.vaddr;
+		seg[nseg].memsz	 = ph.memsz;
+		seg[nseg].off	 = ph.off;
+		seg[nseg].filesz = ph.filesz;
+		seg[nseg].perm	 = flags2perm(ph.flags);
+		nseg++;
+		sz = ph.vaddr + ph.memsz;
 	}
+	// the file must not change while its pages are faulted in.
+	if (deny_write_access(ip) < 0)
+		goto bad;
+	exec_ip = idup(ip);
 	iunlockput(ip);
 	end_op();
 	ip = 0;
@@ -120,12 +136,28 @@ int exec(char *path, char **argv) {
 	safestrcpy(p->name, last, sizeof(p->name));
 
 	// Commit to the user image.
+	vma_unmap_all(p);
 	oldpagetable	  = p->pagetable;
 	p->pagetable	  = pagetable;
 	p->sz			  = sz;
 	p->trapframe->epc = elf.entry; // initial program counter = main
 	p->trapframe->sp  = sp;		   // initial stack pointer
 	proc_freepagetable(oldpagetable, oldsz);
+	asid_release(p);
+	// the new image is faulted in from the node we run on.
+	p->home_node = this_node();
+
+	// the segments page in from the new program file from now on.
+	memmove(p->seg, seg, sizeof(seg));
+	p->nseg	   = nseg;
+	ip		   = p->exec_ip;
+	p->exec_ip = exec_ip;
+	if (ip) {
+		allow_write_access(ip);
+		begin_op();
+		iput(ip);
+		end_op();
+	}
 
 	return argc; // this ends up in a0, the first argument to main(argc, argv)
 
@@ -136,32 +168,57 @@ bad:
 		iunlockput(ip);
 		end_op();
 	}
+	if (exec_ip) {
+		allow_write_access(exec_ip);
+		begin_op();
+		iput(exec_ip);
+		end_op();
+	}
 	return -1;
 }
 
-// Load a program segment into pagetable at virtual address va.
-// va must be page-aligned
-// and the pages from va to va+sz must already be mapped.
+// The segment of p's program which va lies in, or 0.
+struct exec_seg *exec_seg_of(struct proc *p, uint64_t va) {
+	for (int i = 0; i < p->nseg; i++) {
+		if (va >= p->seg[i].vaddr && va < p->seg[i].vaddr + p->seg[i].memsz)
+			return &p->seg[i];
+	}
+	return 0;
+}
+
+// Map the page of segment seg at va into p, reading it from the
+// program file. A read-only page which lies completely in the file
+// is shared with the other processes running the program, any other
+// page is a private copy with the rest past filesz zeroed.
 // Returns 0 on success, -1 on failure.
-static int loadseg(pagetable_t	 pagetable,
-				   uint64_t		 va,
-				   struct inode *ip,
-				   uint			 offset,
-				   uint			 sz) {
-	uint	 i, n;
-	uint64_t pa;
-
-	for (i = 0; i < sz; i += PGSIZE) {
-		pa = walkaddr(pagetable, va + i);
-		if (pa == 0)
-			panic("loadseg: address should exist");
-		if (sz - i < PGSIZE)
-			n = sz - i;
-		else
-			n = PGSIZE;
-		if (readi(ip, 0, (uint64_t)pa, offset + i, n) != n)
-			return -1;
+int exec_loadpage(struct proc *p, struct exec_seg *seg, uint64_t va) {
+	struct inode *ip = p->exec_ip;
+	uint64_t	  pos, n;
+	char		 *mem;
+
+	va	= PGROUNDDOWN(va);
+	pos = va - seg->vaddr; // offset in the segment
+
+	ilock(ip);
+	if ((seg->perm & PTE_W) == 0 && pos + PGSIZE <= seg->filesz &&
+		(seg->off + pos) % PGSIZE == 0) {
+		mem = ipage_get(ip, seg->off + pos);
 	}
+	else if ((mem = kzalloc()) != 0 && pos < seg->filesz) {
+		n = min(seg->filesz - pos, (uint64_t)PGSIZE);
+		if (readi(ip, 0, (uint64_t)mem, seg->off + pos, n) != n) {
+			kfree(mem);
+			mem = 0;
+		}
+	}
+	iunlock(ip);
+	if (mem == 0)
+		return -1;
 
+	if (mappages(p->pagetable, va, PGSIZE, (uint64_t)mem,
+				 seg->perm | PTE_R | PTE_U) != 0) {
+		kfree(mem);
+		return -1;
+	}
 	return 0;
 }
@@ -9,31 +9,30 @@
 #include "proc.h"
 #include "riscv.h"
 #include "sleeplock.h"
+#include "slab.h"
 #include "spinlock.h"
 #include "stat.h"
 
 struct devsw devsw[NDEV];
 struct {
-	struct spinlock lock;
-	struct file		file[NFILE];
+	struct spinlock	   lock; // protects ref of every file
+	struct kmem_cache *cache;
 } ftable;
 
-void fileinit(void) { initlock(&ftable.lock, "ftable"); }
+void fileinit(void) {
+	initlock(&ftable.lock, "ftable");
+	ftable.cache = kmem_cache_create("file", sizeof(struct file), 0);
+	pipeinit();
+}
 
 // Allocate a file structure.
 struct file *filealloc(void) {
 	struct file *f;
 
-	acquire(&ftable.lock);
-	for (f = ftable.file; f < ftable.file + NFILE; f++) {
-		if (f->ref == 0) {
-			f->ref = 1;
-			release(&ftable.lock);
-			return f;
-		}
-	}
-	release(&ftable.lock);
-	return 0;
+	if ((f = kmem_cache_zalloc(ftable.cache)) == 0)
+		return 0;
+	f->ref = 1;
+	return f;
 }
 
 // Increment ref count for file f.
@@ -57,15 +56,16 @@ void fileclose(struct file *f) {
 		release(&ftable.lock);
 		return;
 	}
-	ff		= *f;
-	f->ref	= 0;
-	f->type = FD_NONE;
+	ff = *f;
 	release(&ftable.lock);
+	kmem_cache_free(ftable.cache, f);
 
 	if (ff.type == FD_PIPE) {
 		pipeclose(ff.pipe, ff.writable);
 	}
 	else if (ff.type == FD_INODE || ff.type == FD_DEVICE) {
+		if (ff.writable && ff.ip->type == T_FILE)
+			put_write_access(ff.ip);
 		begin_op();
 		iput(ff.ip);
 		end_op();
@@ -103,9 +103,14 @@ int fileread(struct file *f, uint64_t addr, int n) {
 	else if (f->type == FD_DEVICE) {
 		if (f->major < 0 || f->major >= NDEV || !devsw[f->major].read)
 			return -1;
+		// the console copies out holding its lock.
+		if (n > 0)
+			uvmprefault(this_proc(), addr, n);
 		r = devsw[f->major].read(1, addr, n);
 	}
 	else if (f->type == FD_INODE) {
+		if (n > 0) // before taking an inode lock
+			uvmprefault(this_proc(), addr, n);
 		ilock(f->ip);
 		if ((r = readi(f->ip, 1, addr, f->off, n)) > 0)
 			f->off += r;
@@ -135,6 +140,8 @@ int filewrite(struct file *f, uint64_t addr, int n) {
 		ret = devsw[f->major].write(1, addr, n);
 	}
 	else if (f->type == FD_INODE) {
+		if (n > 0) // before taking an inode lock
+			uvmprefault(this_proc(), addr, n);
 		// write a few blocks at a time to avoid exceeding
 		// the maximum log transaction size, including
 		// i-node, indirect block, allocation blocks,
@@ -13,15 +13,17 @@
 #include "buf.h"
 #include "kernel.h"
 #include "file.h"
+#include "math.h"
+#include "mm.h"
 #include "param.h"
 #include "proc.h"
 #include "riscv.h"
 #include "sleeplock.h"
+#include "slab.h"
 #include "spinlock.h"
 #include "stat.h"
 #include "types.h"
 
-#define min(a, b) ((a) < (b) ? (a) : (b))
 // there should be one superblock per disk device, but we run with
 // only one device
 struct superblock sb;
@@ -155,30 +157,32 @@ static void bfree(int dev, uint b) {
 // have locked the inodes involved; this lets callers create
 // multi-step atomic operations.
 //
-// The itable.lock spin-lock protects the allocation of itable
-// entries. Since ip->ref indicates whether an entry is free,
-// and ip->dev and ip->inum indicate which i-node an entry
-// holds, one must hold itable.lock while using any of those fields.
+// The itable.lock spin-lock serializes changes to the list of
+// in-memory inodes. Inodes are allocated from a slab cache on demand
+// and freed once ip->ref drops to zero, and ip->dev and ip->inum
+// indicate which i-node an entry holds. iget() looks an inode up
+// without the lock, in an rcu read section: entries are unlinked
+// with list_del_rcu() and freed after a grace period, and ip->ref
+// changes atomically, a lookup only takes a ref while it is not 0.
 //
 // An ip->lock sleep-lock protects all ip-> fields other than ref,
 // dev, and inum.  One must hold ip->lock in order to
 // read or write that inode's ip->valid, ip->size, ip->type, &c.
 
 struct {
-	struct spinlock lock;
-	struct inode	inode[NINODE];
+	struct spinlock	   lock;
+	struct list_head   inodes; // inodes with ref > 0
+	struct kmem_cache *cache;
 } itable;
 
 void iinit() {
-	int i = 0;
-
 	initlock(&itable.lock, "itable");
-	for (i = 0; i < NINODE; i++) {
-		init_sleeplock(&itable.inode[i].lock, "inode");
-	}
+	INIT_LIST_HEAD(&itable.inodes);
+	itable.cache = kmem_cache_create("inode", sizeof(struct inode), 0);
 }
 
 static struct inode *iget(uint dev, uint inum);
+static void			 ipage_update(struct inode *ip, uint off, uint n);
 
 // Allocate an inode on device dev.
 // Mark it as allocated by  giving it type type.
@@ -228,32 +232,53 @@ void iupdate(struct inode *ip) {
 // Find the inode with number inum on device dev
 // and return the in-memory copy. Does not lock
 // the inode and does not read it from disk.
-static struct inode *iget(uint dev, uint inum) {
-	struct inode *ip, *empty;
+// Take a ref of ip, unless the last one is gone and ip is being freed.
+static int iget_unless_zero(struct inode *ip) {
+	int ref = __atomic_load_n(&ip->ref, __ATOMIC_RELAXED);
+
+	while (ref > 0) {
+		if (__atomic_compare_exchange_n(&ip->ref, &ref, ref + 1, 0,
+										__ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+			return 1;
+	}
+	return 0;
+}
 
-	acquire(&itable.lock);
+static struct inode *iget(uint dev, uint inum) {
+	struct inode *ip;
 
 	// Is the inode already in the table?
-	empty = 0;
-	for (ip = &itable.inode[0]; ip < &itable.inode[NINODE]; ip++) {
-		if (ip->ref > 0 && ip->dev == dev && ip->inum == inum) {
-			ip->ref++;
+	rcu_read_lock();
+	list_for_each_entry_rcu(ip, &itable.inodes, list) {
+		if (ip->dev == dev && ip->inum == inum && iget_unless_zero(ip)) {
+			rcu_read_unlock();
+			return ip;
+		}
+	}
+	rcu_read_unlock();
+
+	// Look again, it may have been added in the meantime.
+	acquire(&itable.lock);
+	list_for_each_entry(ip, &itable.inodes, list) {
+		if (ip->dev == dev && ip->inum == inum) {
+			__atomic_fetch_add(&ip->ref, 1, __ATOMIC_RELAXED);
 			release(&itable.lock);
 			return ip;
 		}
-		if (empty == 0 && ip->ref == 0) // Remember empty slot.
-			empty = ip;
 	}
 
-	// Recycle an inode entry.
-	if (empty == 0)
+	// Allocate a new inode entry.
+	if ((ip = kmem_cache_zalloc(itable.cache)) == 0)
 		panic("iget: no inodes");
 
-	ip		  = empty;
+	init_sleeplock(&ip->lock, "inode");
+	INIT_LIST_HEAD(&ip->pages);
 	ip->dev	  = dev;
 	ip->inum  = inum;
-	ip->ref	  = 1;
-	ip->valid = 0;
+	ip->ref		   = 1;
+	ip->valid	   = 0;
+	ip->writecount = 0;
+	list_add_rcu(&ip->list, &itable.inodes);
 	release(&itable.lock);
 
 	return ip;
@@ -262,9 +287,7 @@ static struct inode *iget(uint dev, uint inum) {
 // Increment reference count for ip.
 // Returns ip to enable ip = idup(ip1) idiom.
 struct inode *idup(struct inode *ip) {
-	acquire(&itable.lock);
-	ip->ref++;
-	release(&itable.lock);
+	__atomic_fetch_add(&ip->ref, 1, __ATOMIC_RELAXED); // caller has a ref
 	return ip;
 }
 
@@ -303,9 +326,14 @@ void iunlock(struct inode *ip) {
 	release_sleep(&ip->lock);
 }
 
+// Free ip once no lookup can still be looking at it.
+static void ifree_rcu(struct rcu_head *head) {
+	kmem_cache_free(itable.cache, container_of(head, struct inode, rcu));
+}
+
 // Drop a reference to an in-memory inode.
-// If that was the last reference, the inode table entry can
-// be recycled.
+// If that was the last reference, the inode table entry is
+// freed.
 // If that was the last reference and the inode has no links
 // to it, free the inode (and its content) on disk.
 // All calls to iput() must be inside a transaction in
@@ -332,10 +360,55 @@ void iput(struct inode *ip) {
 		acquire(&itable.lock);
 	}
 
-	ip->ref--;
+	if (__atomic_sub_fetch(&ip->ref, 1, __ATOMIC_ACQ_REL) == 0) {
+		list_del_rcu(&ip->list);
+		release(&itable.lock);
+		ipage_drop(ip);
+		call_rcu(&ip->rcu, ifree_rcu); // lookups may still look at it
+		return;
+	}
 	release(&itable.lock);
 }
 
+// ip->writecount keeps running programs from changing under them:
+// their text is paged in from the file, and its pages are shared
+// with the page cache. Files open for writing can not be executed,
+// and executed files can not be opened for writing.
+
+// Take write access to ip for an open file.
+// Returns -1 if a process runs ip.
+int get_write_access(struct inode *ip) {
+	int n = __atomic_load_n(&ip->writecount, __ATOMIC_RELAXED);
+
+	do {
+		if (n < 0)
+			return -1;
+	} while (!__atomic_compare_exchange_n(&ip->writecount, &n, n + 1, 0,
+										  __ATOMIC_ACQUIRE, __ATOMIC_RELAXED));
+	return 0;
+}
+
+void put_write_access(struct inode *ip) {
+	__atomic_fetch_sub(&ip->writecount, 1, __ATOMIC_RELEASE);
+}
+
+// Keep ip from being written while a process runs it.
+// Returns -1 if ip is open for writing.
+int deny_write_access(struct inode *ip) {
+	int n = __atomic_load_n(&ip->writecount, __ATOMIC_RELAXED);
+
+	do {
+		if (n > 0)
+			return -1;
+	} while (!__atomic_compare_exchange_n(&ip->writecount, &n, n - 1, 0,
+										  __ATOMIC_ACQUIRE, __ATOMIC_RELAXED));
+	return 0;
+}
+
+void allow_write_access(struct inode *ip) {
+	__atomic_fetch_add(&ip->writecount, 1, __ATOMIC_RELEASE);
+}
+
 // Common idiom: unlock, then put.
 void iunlockput(struct inode *ip) {
 	iunlock(ip);
@@ -419,6 +492,9 @@ void itrunc(struct inode *ip) {
 
 	ip->size = 0;
 	iupdate(ip);
+
+	// mappings of the old contents keep their pages.
+	ipage_drop(ip);
 }
 
 // Copy stat information from inode.
@@ -492,6 +568,7 @@ int writei(struct inode *ip, int user_src, uint64_t src, uint off, uint n) {
 
 	if (off > ip->size)
 		ip->size = off;
+	ipage_update(ip, off - tot, tot);
 
 	// write the i-node back to disk even if the size didn't change
 	// because the loop above might have called bmap() and added a new
@@ -501,6 +578,77 @@ int writei(struct inode *ip, int user_src, uint64_t src, uint off, uint n) {
 	return tot;
 }
 
+// Page cache
+//
+// Pages of a file which are mapped into user memory, the read-only
+// text of programs and mmap()ed files, are cached on the inode so
+// all processes mapping the same file share them and each page is
+// only read from disk once while the inode is in use. A page is
+// held once by the cache (the kalloc() of it) and once more for
+// each mapping (kdup()). writei() keeps the cached pages up to date.
+// The list is protected by ip->lock.
+
+// Return the page at file offset off of ip, with a hold of it taken
+// for the caller. off must be page aligned and inside the file, the
+// part of the page past the end of the file is zero. Returns 0 if
+// out of memory or the read failed. Caller must hold ip->lock.
+void *ipage_get(struct inode *ip, uint off) {
+	struct page *page;
+	char		*mem;
+	uint		 n;
+
+	if (!holding_sleep(&ip->lock) || off % PGSIZE != 0 || off >= ip->size)
+		panic("ipage_get");
+
+	list_for_each_entry(page, &ip->pages, list) {
+		if (page->index == off) {
+			mem = page_to_virt(page);
+			kdup(mem);
+			return mem;
+		}
+	}
+
+	if ((mem = kzalloc()) == 0)
+		return 0;
+	n = min(ip->size - off, PGSIZE);
+	if (readi(ip, 0, (uint64_t)mem, off, n) != n) {
+		kfree(mem);
+		return 0;
+	}
+	page		= virt_to_page(mem);
+	page->index = off;
+	list_add(&page->list, &ip->pages);
+	kdup(mem);
+	return mem;
+}
+
+// Copy bytes [off, off + n) of ip, which have just been written,
+// into the cached pages. Caller must hold ip->lock.
+static void ipage_update(struct inode *ip, uint off, uint n) {
+	struct page *page;
+	uint		 lo, hi;
+
+	list_for_each_entry(page, &ip->pages, list) {
+		lo = max(off, (uint)page->index);
+		hi = min(off + n, (uint)page->index + PGSIZE);
+		if (lo < hi)
+			readi(ip, 0, (uint64_t)page_to_virt(page) + lo - page->index, lo,
+				  hi - lo);
+	}
+}
+
+// Let go of the cached pages of ip, pages still mapped by processes
+// stay with them until they are unmapped. Caller must hold ip->lock
+// or the last reference of ip.
+void ipage_drop(struct inode *ip) {
+	struct page *page, *tmp;
+
+	list_for_each_entry_safe(page, tmp, &ip->pages, list) {
+		list_del(&page->list);
+		kfree(page_to_virt(page));
+	}
+}
+
 // Directories
 
 int namecmp(const char *s, const char *t) { return strncmp(s, t, DIRSIZ); }
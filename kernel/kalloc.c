@@ -1,97 +1,74 @@
 // Physical memory allocator, for user processes,
 // kernel stacks, page-table pages,
 // and pipe buffers. Allocates whole 4096-byte pages.
+// Single pages are served by the per-cpu page lists of the
+// buddy system, so kalloc()/kfree() take no lock in the common case.
 
-#include "device_tree.h"
 #include "kernel.h"
-#include "memlayout.h"
-#include "param.h"
+#include "mm.h"
 #include "riscv.h"
-#include "spinlock.h"
 #include "types.h"
 
-void freerange(void *pa_start, void *pa_end);
-
-struct run {
-	struct run *next;
-};
-
-struct {
-	struct spinlock lock;
-	struct run	   *freelist;
-	uint64_t		npage;
-	uint64_t		ram_start;
-	uint64_t		ram_avail_start;
-	uint64_t		ram_size;
-	uint64_t		ram_avail_size;
-	uint64_t		ram_stop;
-	uint64_t		kernel_start;
-	uint64_t		kernel_end;
-} kmem;
-
-void kinit() {
-	initlock(&kmem.lock, "kmem");
-	kmem.freelist		 = 0;
-	kmem.npage			 = 0;
-	kmem.kernel_start	 = (uint64_t)kernel_start;
-	kmem.kernel_end		 = (uint64_t)kernel_end;
-	kmem.ram_start		 = ram_start();
-	kmem.ram_avail_start = (uint64_t)kernel_end;
-	kmem.ram_size		 = ram_size();
-	kmem.ram_stop		 = kmem.ram_start + kmem.ram_size;
-	kmem.ram_avail_size	 = kmem.ram_stop - kmem.ram_avail_start;
-	freerange((void *)kmem.ram_avail_start, (void *)kmem.ram_stop);
-	pr_info("kernel_end: %p, phystop: %p", kernel_end, (void *)kmem.ram_stop);
-	pr_info("kinit");
-}
-
-void freerange(void *pa_start, void *pa_end) {
-	char *p;
-	p = (char *)PGROUNDUP((uint64_t)pa_start);
-	for (; p + PGSIZE <= (char *)pa_end; p += PGSIZE)
-		kfree(p);
-}
-
 // Free the page of physical memory pointed at by pa,
 // which normally should have been returned by a
-// call to kalloc().  (The exception is when
-// initializing the allocator; see kinit above.)
+// call to kalloc(). A page shared by kdup() is only
+// freed when its last holder lets go of it.
 void kfree(void *pa) {
-	struct run *r;
+	struct page *page;
 
-	if (((uint64_t)pa % PGSIZE) != 0 || (uint64_t)pa < kmem.kernel_end ||
-		(uint64_t)pa >= kmem.ram_stop)
+	if (((uint64_t)pa % PGSIZE) != 0 || (uint64_t)pa < (uint64_t)kernel_end)
 		panic("kfree");
 
+	page = virt_to_page(pa);
+	if (page && __atomic_sub_fetch(&page->refcount, 1, __ATOMIC_ACQ_REL) != 0)
+		return;
+
+#ifdef CONFIG_PAGE_POISON
 	// Fill with junk to catch dangling refs.
-	memset(pa, 1, PGSIZE);
+	memset(pa, PAGE_POISON_FREE, PGSIZE);
+#endif
+
+	free_pages(pa, 1);
+}
+
+// Allocate one 4096-byte page of physical memory,
+// zeroed if gfp has __GFP_ZERO, otherwise left as it is.
+static void *__kalloc(gfp_t gfp) {
+	void *pa;
 
-	r = (struct run *)pa;
+	// zeroed pages usually come ready from the zero pool.
+	if (gfp & __GFP_ZERO)
+		return alloc_zero_pages(1);
 
-	acquire(&kmem.lock);
-	r->next		  = kmem.freelist;
-	kmem.freelist = r;
-	kmem.npage++;
-	release(&kmem.lock);
+	pa = alloc_pages(1);
+#ifdef CONFIG_PAGE_POISON
+	if (pa)
+		memset(pa, PAGE_POISON_ALLOC, PGSIZE); // fill with junk
+#endif
+	return pa;
 }
 
 // Allocate one 4096-byte page of physical memory.
 // Returns a pointer that the kernel can use.
 // Returns 0 if the memory cannot be allocated.
-void *kalloc(void) {
-	struct run *r;
+void *kalloc(void) { return __kalloc(0); }
 
-	acquire(&kmem.lock);
-	r = kmem.freelist;
-	if (r) {
-		kmem.freelist = r->next;
-		kmem.npage--;
-	}
-	release(&kmem.lock);
+// Same as kalloc(), but the page is zeroed.
+void *kzalloc(void) { return __kalloc(__GFP_ZERO); }
 
-	if (r)
-		memset((char *)r, 5, PGSIZE); // fill with junk
-	return (void *)r;
+// Take another hold of page pa, which must come from kalloc(),
+// so it can be shared until everyone has called kfree() on it.
+void kdup(void *pa) {
+	struct page *page = virt_to_page(pa);
+
+	if (page == 0)
+		panic("kdup");
+	__atomic_fetch_add(&page->refcount, 1, __ATOMIC_RELAXED);
 }
 
-uint64_t freemem_amount(void) { return kmem.npage << PGSHIFT; }
+// Whether page pa has other holders than the caller.
+int kshared(void *pa) {
+	struct page *page = virt_to_page(pa);
+
+	return page && __atomic_load_n(&page->refcount, __ATOMIC_ACQUIRE) > 1;
+}
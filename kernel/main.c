@@ -3,8 +3,10 @@
 #include "memlayout.h"
 #include "mm.h"
 #include "param.h"
+#include "rcu.h"
 #include "riscv.h"
 #include "sbi.h"
+#include "slab.h"
 #include "types.h"
 
 static inline void init_hartid(unsigned long hartid) { w_tp(hartid); }
@@ -24,11 +26,24 @@ int main(unsigned long hartid, unsigned long dtb_pa) {
 		printk("\n");
 		parse_device_tree(dtb_pa);
 		sys_info();
+		string_init(); // pick mem* routines by isa
 
+		numa_init();	 // sort numa nodes by distance
 		bootmem_init();	 // init bootmem
 		kern_vm_init();	 // create kernel page table
 		kvm_init_hart(); // turn on paging
+		asid_init();	 // count the ASIDs of the harts
+		buddy_init();	 // hand free memory over to the buddy system
+		kmem_cache_init(); // init slab allocator
+		rcuinit();		 // grace periods for lockless readers
+#ifdef CONFIG_STRING_BENCH
+		string_bench();
+#endif
 		timerinit();	 // init a lock for timer
+#ifdef CONFIG_WAKEUP_BENCH
+		procinit(); // the bench needs the proc table
+		wakeup_bench();
+#endif
 		pr_info("hart %d init done", hartid);
 
 		for (int i = 1; i < cpu_num(); i++) {
@@ -48,10 +63,13 @@ int main(unsigned long hartid, unsigned long dtb_pa) {
 		pr_info("hart %d init done", hartid);
 	}
 
+	string_init_hart(); // vector unit off until the mem* routines use it
+
 	// install kernel trap vector, including interrupt handler
 	trapinithart();
 
-	while (1) {}
+	while (1)
+		cpu_idle();
 
 	return 0;
 }
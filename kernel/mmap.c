@@ -0,0 +1,327 @@
+// Memory mapped files and anonymous memory, mmap() and munmap().
+// The mappings of a process are kept in p->vmas sorted by address
+// and placed top down from MMAP_TOP, above the heap. Their pages are
+// only faulted in when touched. Pages of files come from the page
+// cache of the inode, see ipage_get(), so reading a mapped file
+// costs no copy: MAP_SHARED maps the cached pages themselves and
+// munmap() writes the dirty ones back to the file, MAP_PRIVATE maps
+// them copy-on-write.
+
+#include "kernel.h"
+#include "fcntl.h"
+#include "file.h"
+#include "fs.h"
+#include "math.h"
+#include "memlayout.h"
+#include "param.h"
+#include "proc.h"
+#include "riscv.h"
+#include "slab.h"
+#include "types.h"
+
+static struct kmem_cache *vma_cache;
+
+void mmapinit(void) {
+	vma_cache = kmem_cache_create("vma", sizeof(struct vma), 0);
+}
+
+// The mapping of p which va lies in, or 0.
+struct vma *vma_find(struct proc *p, uint64_t va) {
+	struct vma *v;
+
+	list_for_each_entry(v, &p->vmas, list) {
+		if (va < v->start)
+			break;
+		if (va < v->end)
+			return v;
+	}
+	return 0;
+}
+
+// Lowest address used by the mappings of p, the heap stays below.
+uint64_t vma_lowest(struct proc *p) {
+	if (list_empty(&p->vmas))
+		return MMAP_TOP;
+	return list_first_entry(&p->vmas, struct vma, list)->start;
+}
+
+// Add v to the mappings of p, keeping them sorted.
+static void vma_insert(struct proc *p, struct vma *v) {
+	struct vma *pos;
+
+	list_for_each_entry(pos, &p->vmas, list) {
+		if (pos->start > v->start)
+			break;
+	}
+	list_add_tail(&v->list, &pos->list);
+}
+
+// Start of the highest free range of len bytes above the heap,
+// or 0 if there is none.
+static uint64_t vma_gap(struct proc *p, uint64_t len) {
+	struct vma *v;
+	uint64_t	end = MMAP_TOP;
+
+	list_for_each_entry_reverse(v, &p->vmas, list) {
+		if (end - v->end >= len)
+			break;
+		end = v->start;
+	}
+	if (end < len || end - len < PGROUNDUP(p->sz))
+		return 0;
+	return end - len;
+}
+
+// Write the dirty pages of a shared file mapping in [start, end)
+// back to the file, but not past its end.
+static void
+vma_writeback(struct proc *p, struct vma *v, uint64_t start, uint64_t end) {
+	struct inode *ip = v->file->ip;
+	pte_t		  *pte;
+	uint64_t	  va, pa, off;
+	// a few blocks at a time to fit in a log transaction, see filewrite().
+	uint max = ((MAXOPBLOCKS - 1 - 1 - 2) / 2) * BSIZE;
+
+	for (va = start; va < end; va += PGSIZE) {
+		pte = walk(p->pagetable, va, 0);
+		if (pte == 0 || (*pte & PTE_V) == 0 || (*pte & PTE_D) == 0)
+			continue;
+		pa	= PTE2PA(*pte);
+		off = v->off + (va - v->start);
+		for (uint i = 0; i < PGSIZE; i += max) {
+			begin_op();
+			ilock(ip);
+			if (off + i < ip->size)
+				writei(ip, 0, pa + i, off + i,
+					   min(ip->size - (off + i), (uint64_t)min(max, PGSIZE - i)));
+			iunlock(ip);
+			end_op();
+		}
+	}
+}
+
+// Unmap [start, end) of mapping v of p, which must lie inside v,
+// adding the pages to batch to be flushed from the TLBs unless it
+// is 0. v is trimmed, split in two or freed as needed.
+// Returns 0 on success, -1 if out of memory.
+static int vma_unmap(struct proc *p, struct vma *v, uint64_t start,
+					 uint64_t end, struct tlb_batch *batch) {
+	struct vma *nv;
+
+	if (start > v->start && end < v->end) {
+		// a hole in the middle, the part above it gets its own vma.
+		if ((nv = kmem_cache_alloc(vma_cache)) == 0)
+			return -1;
+		*nv		  = *v;
+		nv->start = end;
+		nv->off	  = v->off + (end - v->start);
+		if (nv->file)
+			filedup(nv->file);
+		list_add(&nv->list, &v->list);
+		v->end = end;
+	}
+
+	if (v->file && (v->flags & MAP_SHARED))
+		vma_writeback(p, v, start, end);
+	uvmunmap(p->pagetable, start, (end - start) / PGSIZE, 1);
+	if (batch)
+		tlb_batch_add(batch, start, end);
+
+	if (start == v->start && end == v->end) {
+		list_del(&v->list);
+		if (v->file)
+			fileclose(v->file);
+		kmem_cache_free(vma_cache, v);
+	}
+	else if (start == v->start) {
+		v->off += end - v->start;
+		v->start = end;
+	}
+	else {
+		v->end = start;
+	}
+	return 0;
+}
+
+// Map len bytes of file f from offset off, or anonymous memory if
+// flags has MAP_ANONYMOUS, into the current process. The mapping is
+// placed at addr if flags has MAP_FIXED, replacing what was there.
+// Returns the address of the mapping, or -1.
+uint64_t mmap(uint64_t addr, uint64_t len, int prot, int flags,
+			  struct file *f, uint64_t off) {
+	struct proc *p = this_proc();
+	struct vma	*v;
+	int			 perm = 0;
+
+	// exactly one of MAP_SHARED and MAP_PRIVATE.
+	if (!(flags & MAP_SHARED) == !(flags & MAP_PRIVATE))
+		return -1;
+	if (len == 0 || len > MMAP_TOP || off % PGSIZE != 0)
+		return -1;
+	len = PGROUNDUP(len);
+
+	// riscv has no write-only pages.
+	if (prot & (PROT_READ | PROT_WRITE | PROT_EXEC))
+		perm |= PTE_R;
+	if (prot & PROT_WRITE)
+		perm |= PTE_W;
+	if (prot & PROT_EXEC)
+		perm |= PTE_X;
+
+	if (flags & MAP_ANONYMOUS) {
+		f	= 0;
+		off = 0;
+	}
+	else {
+		if (f == 0 || f->type != FD_INODE || !f->readable)
+			return -1;
+		if ((flags & MAP_SHARED) && (prot & PROT_WRITE) && !f->writable)
+			return -1;
+		if (off >= MAXFILE * BSIZE)
+			return -1;
+	}
+
+	if (flags & MAP_FIXED) {
+		if (addr % PGSIZE != 0 || addr < PGROUNDUP(p->sz) ||
+			addr > MMAP_TOP - len)
+			return -1;
+		if (munmap(addr, len) < 0)
+			return -1;
+	}
+	else if ((addr = vma_gap(p, len)) == 0) {
+		return -1;
+	}
+
+	if ((v = kmem_cache_alloc(vma_cache)) == 0)
+		return -1;
+	v->start = addr;
+	v->end	 = addr + len;
+	v->perm	 = perm;
+	v->flags = flags;
+	v->file	 = f ? filedup(f) : 0;
+	v->off	 = off;
+	vma_insert(p, v);
+
+	return addr;
+}
+
+// Remove the mappings of the current process in [addr, addr + len).
+// Returns 0 on success, -1 on failure.
+int munmap(uint64_t addr, uint64_t len) {
+	struct proc		*p = this_proc();
+	struct vma		*v, *tmp;
+	struct tlb_batch batch;
+	uint64_t		 end;
+	int				 err = 0;
+
+	if (addr % PGSIZE != 0 || addr >= MMAP_TOP || len == 0 ||
+		len > MMAP_TOP - addr)
+		return -1;
+	end = addr + PGROUNDUP(len);
+
+	tlb_batch_init(&batch, p);
+	list_for_each_entry_safe(v, tmp, &p->vmas, list) {
+		if (v->end <= addr || v->start >= end)
+			continue;
+		if (vma_unmap(p, v, max(addr, v->start), min(end, v->end), &batch) <
+			0) {
+			err = -1;
+			break;
+		}
+	}
+	tlb_batch_flush(&batch);
+	return err;
+}
+
+// Map the page at va of mapping v into p on a page fault.
+// Returns 0 on success, -1 if the access is not allowed, va is
+// past the end of the file or out of memory.
+int vma_fault(struct proc *p, struct vma *v, uint64_t va, int write) {
+	struct inode *ip;
+	uint64_t	  off, n;
+	char		 *mem  = 0;
+	int			  perm = v->perm;
+
+	if (perm == 0 || (write && !(perm & PTE_W)))
+		return -1;
+	va = PGROUNDDOWN(va);
+
+	if (v->file == 0) {
+		mem = kzalloc();
+	}
+	else {
+		ip	= v->file->ip;
+		off = v->off + (va - v->start);
+		ilock(ip);
+		if (off >= ip->size) {
+			// past the end of the file.
+		}
+		else if ((v->flags & MAP_SHARED) || !write) {
+			mem = ipage_get(ip, off);
+			// a private mapping copies the page on the first store.
+			if ((v->flags & MAP_PRIVATE) && (perm & PTE_W))
+				perm = (perm & ~PTE_W) | PTE_COW;
+		}
+		else if ((mem = kzalloc()) != 0) {
+			n = min(ip->size - off, (uint64_t)PGSIZE);
+			if (readi(ip, 0, (uint64_t)mem, off, n) != n) {
+				kfree(mem);
+				mem = 0;
+			}
+		}
+		iunlock(ip);
+	}
+	if (mem == 0)
+		return -1;
+
+	if (mappages(p->pagetable, va, PGSIZE, (uint64_t)mem, perm | PTE_U) != 0) {
+		kfree(mem);
+		return -1;
+	}
+	return 0;
+}
+
+// Give the child np of p copies of the mappings of p. Pages of
+// private mappings are shared copy-on-write, pages of shared ones
+// are simply shared. Anonymous shared memory has no page cache to
+// meet in, so it is faulted in before being shared.
+// Returns 0 on success, -1 if out of memory; the caller must then
+// vma_unmap_all(np).
+int vma_copy(struct proc *p, struct proc *np) {
+	struct vma *v, *nv;
+	pte_t	  *pte;
+	uint64_t	va;
+
+	list_for_each_entry(v, &p->vmas, list) {
+		if (v->file == 0 && (v->flags & MAP_SHARED) && v->perm) {
+			for (va = v->start; va < v->end; va += PGSIZE) {
+				pte = walk(p->pagetable, va, 0);
+				if ((pte == 0 || (*pte & PTE_V) == 0) &&
+					vma_fault(p, v, va, 0) < 0)
+					return -1;
+			}
+		}
+
+		if ((nv = kmem_cache_alloc(vma_cache)) == 0)
+			return -1;
+		*nv = *v;
+		if (nv->file)
+			filedup(nv->file);
+		list_add_tail(&nv->list, &np->vmas);
+
+		if (uvmcopy_range(p->pagetable, np->pagetable, v->start, v->end,
+						  v->flags & MAP_SHARED) < 0)
+			return -1;
+	}
+	return 0;
+}
+
+// Remove all mappings of p, on exit and exec. Nothing is flushed
+// from the TLBs: the page table goes away with the ASID of p, whose
+// entries are never used again.
+void vma_unmap_all(struct proc *p) {
+	struct vma *v, *tmp;
+
+	list_for_each_entry_safe(v, tmp, &p->vmas, list)
+		vma_unmap(p, v, v->start, v->end, 0);
+}
@@ -5,6 +5,7 @@
 #include "proc.h"
 #include "riscv.h"
 #include "sleeplock.h"
+#include "slab.h"
 #include "spinlock.h"
 #include "types.h"
 
@@ -19,6 +20,12 @@ struct pipe {
 	int				writeopen; // write fd is still open
 };
 
+static struct kmem_cache *pipe_cache;
+
+void pipeinit(void) {
+	pipe_cache = kmem_cache_create("pipe", sizeof(struct pipe), 0);
+}
+
 int pipealloc(struct file **f0, struct file **f1) {
 	struct pipe *pi;
 
@@ -26,7 +33,7 @@ int pipealloc(struct file **f0, struct file **f1) {
 	*f0 = *f1 = 0;
 	if ((*f0 = filealloc()) == 0 || (*f1 = filealloc()) == 0)
 		goto bad;
-	if ((pi = (struct pipe *)kalloc()) == 0)
+	if ((pi = kmem_cache_alloc(pipe_cache)) == 0)
 		goto bad;
 	pi->readopen  = 1;
 	pi->writeopen = 1;
@@ -45,7 +52,7 @@ int pipealloc(struct file **f0, struct file **f1) {
 
 bad:
 	if (pi)
-		kfree((char *)pi);
+		kmem_cache_free(pipe_cache, pi);
 	if (*f0)
 		fileclose(*f0);
 	if (*f1)
@@ -65,7 +72,7 @@ void pipeclose(struct pipe *pi, int writable) {
 	}
 	if (pi->readopen == 0 && pi->writeopen == 0) {
 		release(&pi->lock);
-		kfree((char *)pi);
+		kmem_cache_free(pipe_cache, pi);
 	}
 	else
 		release(&pi->lock);
@@ -75,6 +82,9 @@ int pipewrite(struct pipe *pi, uint64_t addr, int n) {
 	int			 i	= 0;
 	struct proc *pr = this_proc();
 
+	// all n bytes are copied in holding pi->lock.
+	if (n > 0)
+		uvmprefault(pr, addr, n);
 	acquire(&pi->lock);
 	while (i < n) {
 		if (pi->readopen == 0 || killed(pr)) {
@@ -104,6 +114,9 @@ int piperead(struct pipe *pi, uint64_t addr, int n) {
 	struct proc *pr = this_proc();
 	char		 ch;
 
+	// at most a pipe full is copied out holding pi->lock.
+	if (n > 0)
+		uvmprefault(pr, addr, n < PIPESIZE ? n : PIPESIZE);
 	acquire(&pi->lock);
 	while (pi->nread == pi->nwrite && pi->writeopen) { // DOC: pipe-empty
 		if (killed(pr)) {
@@ -1,12 +1,18 @@
 #include "proc.h"
 #include "kernel.h"
 #include "memlayout.h"
+#include "mm.h"
 #include "param.h"
+#include "rcu.h"
 #include "riscv.h"
+#include "sbi.h"
+#include "slab.h"
 #include "spinlock.h"
 #include "types.h"
 
-struct proc proc[NPROC];
+struct list_head		  proc_list;
+static struct spinlock	  proc_list_lock; // serializes adding to proc_list
+static struct kmem_cache *proc_cache;
 
 struct proc *initproc;
 
@@ -24,32 +30,251 @@ extern char trampoline[]; // trampoline.S
 // must be acquired before any p->lock.
 struct spinlock wait_lock;
 
-// Allocate a page for each process's kernel stack.
-// Map it high in memory, followed by an invalid
-// guard page.
-void proc_mapstacks(pagetable_t kpgtbl) {
-	struct proc *p;
-
-	for (p = proc; p < &proc[NPROC]; p++) {
-		char *pa = kalloc();
-		if (pa == 0)
-			panic("kalloc");
-		uint64_t va = KSTACK((int)(p - proc));
-		kvmmap(kpgtbl, va, (uint64_t)pa, PGSIZE, PTE_R | PTE_W);
-	}
+// Wait queues
+//
+// Sleeping procs are kept in a hash table keyed on the channel, so
+// wakeup() only looks at procs sleeping on channels of one bucket
+// instead of taking the lock of every proc.
+// Lock order: the lock of the sleeper, then a bucket lock, then p->lock.
+#define WAITQ_HASH_BITS 7
+#define WAITQ_SIZE (1 << WAITQ_HASH_BITS)
+
+static struct waitq {
+	struct spinlock	 lock;
+	struct list_head waiters; // procs sleeping on channels of this bucket
+} waitq_table[WAITQ_SIZE];
+
+static inline struct waitq *waitq_of(void *chan) {
+	// multiplicative hash, the high bits mix all bits of the address.
+	return &waitq_table[((uint64_t)chan * 0x9e3779b97f4a7c15UL) >>
+						(64 - WAITQ_HASH_BITS)];
 }
 
 // initialize the proc table.
 void procinit(void) {
-	struct proc *p;
-
 	initlock(&pid_lock, "nextpid");
 	initlock(&wait_lock, "wait_lock");
-	for (p = proc; p < &proc[NPROC]; p++) {
-		initlock(&p->lock, "proc");
-		p->state  = UNUSED;
-		p->kstack = KSTACK((int)(p - proc));
+	initlock(&proc_list_lock, "proc_list");
+	INIT_LIST_HEAD(&proc_list);
+	proc_cache = kmem_cache_create("proc", sizeof(struct proc), 0);
+	mmapinit();
+
+	for (int i = 0; i < MAX_CPU; i++) {
+		initlock(&cpus[i].rq_lock, "runqueue");
+		INIT_LIST_HEAD(&cpus[i].runqueue);
+	}
+	for (int i = 0; i < WAITQ_SIZE; i++) {
+		initlock(&waitq_table[i].lock, "waitq");
+		INIT_LIST_HEAD(&waitq_table[i].waiters);
+	}
+}
+
+// Run queues
+//
+// Every cpu has a queue of RUNNABLE procs waiting for it, so picking
+// the next proc takes one short lock and no walk over all procs. A
+// proc is put on the queue of the cpu that makes it RUNNABLE, or on
+// the cpu it ran on last when woken up, so it finds its caches warm.
+// A cpu with an empty queue steals, from cpus of its own numa node
+// first, then from the nearest nodes, and waits in wfi if there is
+// nothing to steal. Queueing a proc wakes such a cpu with an ipi.
+// Lock order: p->lock, then a rq_lock.
+
+// queued procs a cpu of another node needs before one of them is
+// pulled away from its home node, where all its accesses are local.
+#define NUMA_STEAL_MIN 2
+
+// Per numa node scheduler stats.
+static struct {
+	uint64_t in;	   // procs moved to a cpu of this node from another node
+	uint64_t out;	   // procs moved away from a cpu of this node
+	uint64_t off_home; // moves to this node of procs homed elsewhere
+} numa_migrations[MAX_NUMA_NODE];
+
+static uint64_t idle_cpus; // cpus waiting in wfi for work
+
+static inline int cpu_node(int cpu) { return cpu_of(cpu)->numa_node_id; }
+
+// Wake up an idle cpu for a proc just queued on cpu, which has queued
+// procs waiting: cpu itself if it is idle, otherwise an idle cpu
+// of the same numa node or else any idle cpu, which may steal it.
+static void rq_kick(int cpu, int queued) {
+	uint64_t idle = __atomic_load_n(&idle_cpus, __ATOMIC_SEQ_CST);
+	int		 target = -1;
+
+	if (idle & (1UL << cpu)) {
+		target = cpu;
+	}
+	else if (idle && queued > 1) {
+		for (int i = 0; i < cpu_num(); i++) {
+			if (!(idle & (1UL << i)))
+				continue;
+			if (target < 0 || (cpu_node(i) == cpu_node(cpu) &&
+							   cpu_node(target) != cpu_node(cpu)))
+				target = i;
+		}
+	}
+	if (target >= 0 && target != cpu_id())
+		sbi_ecall_send_ipi(1UL << target, 0);
+}
+
+// Move p from the cpu it is on to cpu, counting the moves between
+// numa nodes. Caller must hold p->lock or own the dequeued p.
+static void proc_migrate(struct proc *p, int cpu) {
+	int from = cpu_node(p->cpu), to = cpu_node(cpu);
+
+	p->cpu = cpu;
+	if (from == to)
+		return;
+	__sync_fetch_and_add(&numa_migrations[from].out, 1);
+	__sync_fetch_and_add(&numa_migrations[to].in, 1);
+	if (to != p->home_node)
+		__sync_fetch_and_add(&numa_migrations[to].off_home, 1);
+}
+
+// Make p RUNNABLE and queue it on cpu. Caller must hold p->lock.
+static void rq_add(struct proc *p, int cpu) {
+	struct cpu *c = &cpus[cpu];
+	int			queued;
+
+	p->state = RUNNABLE;
+	proc_migrate(p, cpu);
+	acquire(&c->rq_lock);
+	list_add_tail(&p->rq, &c->runqueue);
+	queued = ++c->nr_running;
+	release(&c->rq_lock);
+	rq_kick(cpu, queued);
+}
+
+// Take a proc off the queue of c, from the head if this is the
+// cpu of the queue, otherwise from the tail, which is the proc
+// that would have waited the longest there. Returns 0 if empty.
+static struct proc *rq_take(struct cpu *c, int head) {
+	struct proc *p = 0;
+
+	acquire(&c->rq_lock);
+	if (!list_empty(&c->runqueue)) {
+		p = head ? list_first_entry(&c->runqueue, struct proc, rq)
+				 : list_last_entry(&c->runqueue, struct proc, rq);
+		list_del(&p->rq);
+		c->nr_running--;
+	}
+	release(&c->rq_lock);
+	return p;
+}
+
+static inline int rq_len(int cpu) {
+	return __atomic_load_n(&cpus[cpu].nr_running, __ATOMIC_RELAXED);
+}
+
+// Take a proc for cpu self off the queue of victim, a cpu of another
+// numa node. A proc homed on the node of self comes back home and is
+// taken first; a proc homed on the node of victim is only taken if
+// victim has NUMA_STEAL_MIN procs queued. Returns 0 if none fits.
+static struct proc *rq_take_remote(int self, int victim) {
+	struct cpu	*c	 = &cpus[victim];
+	int			 nid = cpu_node(self);
+	struct proc *p, *found = 0;
+
+	acquire(&c->rq_lock);
+	list_for_each_entry_reverse(p, &c->runqueue, rq) {
+		if (p->home_node == nid) {
+			found = p;
+			break;
+		}
+		if (found == 0 && (p->home_node != cpu_node(victim) ||
+						   c->nr_running >= NUMA_STEAL_MIN))
+			found = p;
+	}
+	if (found) {
+		list_del(&found->rq);
+		c->nr_running--;
 	}
+	release(&c->rq_lock);
+	return found;
+}
+
+// Steal a proc from the other cpus, the nearest numa node first and
+// the longest queue within a node. Returns 0 if none can be taken.
+static struct proc *rq_steal(int self) {
+	int			 nid   = cpu_node(self);
+	uint64_t	 tried = 0;
+	struct proc *p;
+
+	for (;;) {
+		int busiest = -1, bdist = 0, blen = 0;
+
+		for (int i = 0; i < cpu_num(); i++) {
+			int len, dist;
+
+			if (i == self || (tried & (1UL << i)) || (len = rq_len(i)) == 0)
+				continue;
+			dist = node_distance(nid, cpu_node(i));
+			if (busiest < 0 || dist < bdist || (dist == bdist && len > blen)) {
+				busiest = i;
+				bdist	= dist;
+				blen	= len;
+			}
+		}
+		if (busiest < 0)
+			return 0;
+		tried |= 1UL << busiest;
+
+		if (cpu_node(busiest) == nid)
+			p = rq_take(&cpus[busiest], 0);
+		else
+			p = rq_take_remote(self, busiest);
+		if (p) {
+			cpus[self].nr_steals++;
+			return p;
+		}
+	}
+}
+
+// The cpu to queue p on when it wakes up: the cpu it ran on last,
+// unless the waking cpu is on the home node of p and that one is
+// not, or the queue of the waking cpu is shorter. Going to another
+// node for a shorter queue needs NUMA_STEAL_MIN procs of difference.
+static int wakeup_cpu(struct proc *p) {
+	int self = cpu_id(), prev = p->cpu;
+
+	if (cpu_node(self) == p->home_node && cpu_node(prev) != p->home_node)
+		return self;
+	if (cpu_node(self) == cpu_node(prev))
+		return rq_len(self) < rq_len(prev) ? self : prev;
+	return rq_len(self) + NUMA_STEAL_MIN <= rq_len(prev) ? self : prev;
+}
+
+// Nothing to run on this cpu: zero pages for the zero pool, or else
+// wait in wfi for an interrupt, e.g. the ipi of rq_kick(). Called
+// with interrupts on.
+void cpu_idle(void) {
+	int id = cpu_id();
+
+	if (zero_pool_refill())
+		return;
+
+	// rq_add() queues before it looks at idle_cpus, and we look at
+	// the queue after setting our bit, so one of us sees the other.
+	// Grace periods do not wait for us while we sleep in wfi.
+	intr_off();
+	__atomic_fetch_or(&idle_cpus, 1UL << id, __ATOMIC_SEQ_CST);
+	rcu_idle_enter();
+	if (rq_len(id) == 0)
+		wfi();
+	rcu_idle_exit();
+	__atomic_fetch_and(&idle_cpus, ~(1UL << id), __ATOMIC_SEQ_CST);
+	intr_on();
+}
+
+// The numa node the pages of the current cpu are allocated from.
+int this_node(void) {
+	int nid;
+
+	push_off();
+	nid = cpu_node(cpu_id());
+	pop_off();
+	return nid;
 }
 
 // Return the current struct proc *, or zero if none.
@@ -72,14 +297,42 @@ int allocpid() {
 	return pid;
 }
 
-// Look in the process table for an UNUSED proc.
+// Allocate a new proc with a kernel stack page and add it to
+// proc_list. Returns with p->lock held, or 0 if out of memory.
+static struct proc *newproc(void) {
+	struct proc *p;
+
+	if ((p = kmem_cache_zalloc(proc_cache)) == 0)
+		return 0;
+	if ((p->kstack = (uint64_t)kalloc()) == 0) {
+		kmem_cache_free(proc_cache, p);
+		return 0;
+	}
+	initlock(&p->lock, "proc");
+	INIT_LIST_HEAD(&p->vmas);
+	INIT_LIST_HEAD(&p->wait);
+	p->state = UNUSED;
+	acquire(&p->lock);
+
+	// lockless walkers must never see a half linked entry.
+	p->list.next = &proc_list;
+	p->list.prev = proc_list.prev;
+	__sync_synchronize();
+	acquire(&proc_list_lock);
+	list_add_tail(&p->list, &proc_list);
+	release(&proc_list_lock);
+
+	return p;
+}
+
+// Look in the process table for an UNUSED proc, or allocate a new one.
 // If found, initialize state required to run in the kernel,
 // and return with p->lock held.
-// If there are no free procs, or a memory allocation fails, return 0.
+// If a memory allocation fails, return 0.
 static struct proc *allocproc(void) {
 	struct proc *p;
 
-	for (p = proc; p < &proc[NPROC]; p++) {
+	for_each_proc(p) {
 		acquire(&p->lock);
 		if (p->state == UNUSED) {
 			goto found;
@@ -88,11 +341,14 @@ static struct proc *allocproc(void) {
 			release(&p->lock);
 		}
 	}
-	return 0;
+	if ((p = newproc()) == 0)
+		return 0;
 
 found:
-	p->pid	 = allocpid();
-	p->state = USED;
+	p->pid		 = allocpid();
+	p->state	 = USED;
+	p->cpu		 = cpu_id();
+	p->home_node = this_node();
 
 	// Allocate a trapframe page.
 	if ((p->trapframe = (struct trapframe *)kalloc()) == 0) {
@@ -128,7 +384,11 @@ static void freeproc(struct proc *p) {
 	if (p->pagetable)
 		proc_freepagetable(p->pagetable, p->sz);
 	p->pagetable = 0;
+	asid_release(p);
 	p->sz		 = 0;
+	p->min_flt	 = 0;
+	p->nseg		 = 0;
+	p->exec_ip	 = 0;
 	p->pid		 = 0;
 	p->parent	 = 0;
 	p->name[0]	 = 0;
@@ -207,12 +467,14 @@ void userinit(void) {
 	safestrcpy(p->name, "initcode", sizeof(p->name));
 	p->cwd = namei("/");
 
-	p->state = RUNNABLE;
+	rq_add(p, cpu_id());
 
 	release(&p->lock);
 }
 
 // Grow or shrink user memory by n bytes.
+// Growing only moves p->sz, the pages are allocated
+// by uvmfault() when they are first touched.
 // Return 0 on success, -1 on failure.
 int growproc(int n) {
 	uint64_t	 sz;
@@ -220,9 +482,9 @@ int growproc(int n) {
 
 	sz = p->sz;
 	if (n > 0) {
-		if ((sz = uvmalloc(p->pagetable, sz, sz + n, PTE_W)) == 0) {
+		if (sz + n > vma_lowest(p))
 			return -1;
-		}
+		sz += n;
 	}
 	else if (n < 0) {
 		sz = uvmdealloc(p->pagetable, sz, sz + n);
@@ -251,6 +513,17 @@ int fork(void) {
 	}
 	np->sz = p->sz;
 
+	if (vma_copy(p, np) < 0) {
+		// doesn't sleep: the child has no dirty pages, and
+		// the parent still holds the files of the mappings.
+		vma_unmap_all(np);
+		freeproc(np);
+		release(&np->lock);
+		return -1;
+	}
+	memmove(np->seg, p->seg, sizeof(p->seg));
+	np->nseg = p->nseg;
+
 	// copy saved user registers.
 	*(np->trapframe) = *(p->trapframe);
 
@@ -262,9 +535,16 @@ int fork(void) {
 		if (p->ofile[i])
 			np->ofile[i] = filedup(p->ofile[i]);
 	np->cwd = idup(p->cwd);
+	if (p->exec_ip) {
+		deny_write_access(p->exec_ip); // can't fail, p runs it already
+		np->exec_ip = idup(p->exec_ip);
+	}
 
 	safestrcpy(np->name, p->name, sizeof(p->name));
 
+	// the child shares the pages of the parent until it writes them.
+	np->home_node = p->home_node;
+
 	pid = np->pid;
 
 	release(&np->lock);
@@ -274,7 +554,7 @@ int fork(void) {
 	release(&wait_lock);
 
 	acquire(&np->lock);
-	np->state = RUNNABLE;
+	rq_add(np, cpu_id());
 	release(&np->lock);
 
 	return pid;
@@ -285,7 +565,7 @@ int fork(void) {
 void reparent(struct proc *p) {
 	struct proc *pp;
 
-	for (pp = proc; pp < &proc[NPROC]; pp++) {
+	for_each_proc(pp) {
 		if (pp->parent == p) {
 			pp->parent = initproc;
 			wakeup(initproc);
@@ -302,6 +582,9 @@ void exit(int status) {
 	if (p == initproc)
 		panic("init exiting");
 
+	// Write back and drop the mmap()ed memory.
+	vma_unmap_all(p);
+
 	// Close all open files.
 	for (int fd = 0; fd < NOFILE; fd++) {
 		if (p->ofile[fd]) {
@@ -313,8 +596,13 @@ void exit(int status) {
 
 	begin_op();
 	iput(p->cwd);
+	if (p->exec_ip) {
+		allow_write_access(p->exec_ip);
+		iput(p->exec_ip);
+	}
 	end_op();
-	p->cwd = 0;
+	p->cwd	   = 0;
+	p->exec_ip = 0;
 
 	acquire(&wait_lock);
 
@@ -348,7 +636,7 @@ int wait(uint64_t addr) {
 	for (;;) {
 		// Scan through table looking for exited children.
 		havekids = 0;
-		for (pp = proc; pp < &proc[NPROC]; pp++) {
+		for_each_proc(pp) {
 			if (pp->parent == p) {
 				// make sure the child isn't still in exit() or swtch().
 				acquire(&pp->lock);
@@ -393,29 +681,37 @@ int wait(uint64_t addr) {
 //    via swtch back to the scheduler.
 void scheduler(void) {
 	struct proc *p;
-	struct cpu  *c = this_cpu();
+	int			 id = cpu_id();
+	struct cpu  *c	= this_cpu();
 
 	c->proc = 0;
 	for (;;) {
 		// Avoid deadlock by ensuring that devices can interrupt.
 		intr_on();
+		rcu_qs(); // no read section survives a trip to the scheduler
 
-		for (p = proc; p < &proc[NPROC]; p++) {
-			acquire(&p->lock);
-			if (p->state == RUNNABLE) {
-				// Switch to chosen process.  It is the process's job
-				// to release its lock and then reacquire it
-				// before jumping back to us.
-				p->state = RUNNING;
-				c->proc	 = p;
-				swtch(&c->context, &p->context);
-
-				// Process is done running for now.
-				// It should have changed its p->state before coming back.
-				c->proc = 0;
-			}
-			release(&p->lock);
+		if ((p = rq_take(c, 1)) == 0 && (p = rq_steal(id)) == 0) {
+			cpu_idle();
+			continue;
 		}
+
+		acquire(&p->lock);
+		if (p->state != RUNNABLE)
+			panic("scheduler: queued proc not runnable");
+		// Switch to chosen process.  It is the process's job
+		// to release its lock and then reacquire it
+		// before jumping back to us.
+		p->state = RUNNING;
+		proc_migrate(p, id);
+		c->proc = p;
+		timer_start_slice();
+		c->nr_switches++;
+		swtch(&c->context, &p->context);
+
+		// Process is done running for now.
+		// It should have changed its p->state before coming back.
+		c->proc = 0;
+		release(&p->lock);
 	}
 }
 
@@ -448,7 +744,7 @@ void sched(void) {
 void yield(void) {
 	struct proc *p = this_proc();
 	acquire(&p->lock);
-	p->state = RUNNABLE;
+	rq_add(p, p->cpu);
 	sched();
 	release(&p->lock);
 }
@@ -475,21 +771,25 @@ void forkret(void) {
 // Atomically release lock and sleep on chan.
 // Reacquires lock when awakened.
 void sleep(void *chan, struct spinlock *lk) {
-	struct proc *p = this_proc();
+	struct proc	 *p = this_proc();
+	struct waitq *wq = waitq_of(chan);
 
 	// Must acquire p->lock in order to
 	// change p->state and then call sched.
-	// Once we hold p->lock, we can be
+	// Once we are on the wait queue, we can be
 	// guaranteed that we won't miss any wakeup
-	// (wakeup locks p->lock),
+	// (wakeup locks the wait queue),
 	// so it's okay to release lk.
 
+	acquire(&wq->lock);
 	acquire(&p->lock); // DOC: sleeplock1
-	release(lk);
 
 	// Go to sleep.
 	p->chan	 = chan;
 	p->state = SLEEPING;
+	list_add_tail(&p->wait, &wq->waiters);
+	release(lk);
+	release(&wq->lock);
 
 	sched();
 
@@ -501,35 +801,124 @@ void sleep(void *chan, struct spinlock *lk) {
 	acquire(lk);
 }
 
+// Make p, which sleeps on the wait queue wq, RUNNABLE.
+// Caller must hold wq->lock and p->lock.
+static void waitq_wake(struct waitq *wq, struct proc *p) {
+	list_del_init(&p->wait);
+	rq_add(p, wakeup_cpu(p));
+}
+
 // Wake up all processes sleeping on chan.
 // Must be called without any p->lock.
 void wakeup(void *chan) {
-	struct proc *p;
+	struct waitq *wq = waitq_of(chan);
+	struct proc	 *p, *tmp;
 
-	for (p = proc; p < &proc[NPROC]; p++) {
-		if (p != this_proc()) {
+	// a racy peek is fine, sleepers join the queue with the
+	// lock of the channel held, which the caller holds as well.
+	if (list_empty(&wq->waiters))
+		return;
+
+	acquire(&wq->lock);
+	list_for_each_entry_safe(p, tmp, &wq->waiters, wait) {
+		if (p->chan == chan) {
 			acquire(&p->lock);
-			if (p->state == SLEEPING && p->chan == chan) {
-				p->state = RUNNABLE;
-			}
+			waitq_wake(wq, p);
+			release(&p->lock);
+		}
+	}
+	release(&wq->lock);
+}
+
+#ifdef CONFIG_WAKEUP_BENCH
+#define WAKEUP_BENCH_LOOPS 1000
+
+// cycles of one wakeup() on chan, which has a sleeper if p is set.
+static uint64_t wakeup_bench_one(void *chan, struct proc *p) {
+	struct waitq *wq = waitq_of(chan);
+	struct cpu	 *c;
+	uint64_t	  start, cycles = 0;
+
+	for (int i = 0; i < WAKEUP_BENCH_LOOPS; i++) {
+		if (p) {
+			// fake a sleeper, without switching away.
+			acquire(&wq->lock);
+			acquire(&p->lock);
+			p->chan	 = chan;
+			p->state = SLEEPING;
+			list_add_tail(&p->wait, &wq->waiters);
 			release(&p->lock);
+			release(&wq->lock);
 		}
+
+		acquire(&tickslock);
+		start = r_cycle();
+		wakeup(chan);
+		cycles += r_cycle() - start;
+		release(&tickslock);
+
+		if (p) {
+			acquire(&p->lock);
+			c = &cpus[p->cpu];
+			acquire(&c->rq_lock);
+			list_del(&p->rq);
+			c->nr_running--;
+			release(&c->rq_lock);
+			p->chan	 = 0;
+			p->state = UNUSED;
+			release(&p->lock);
+		}
+	}
+	return cycles / WAKEUP_BENCH_LOOPS;
+}
+
+// Report the cycles of a timer tick wakeup, with and without a
+// sleeper, for growing numbers of procs. procinit() must have run.
+void wakeup_bench(void) {
+	struct proc *p, *sleeper = 0;
+	int			 nr = 0;
+
+	printk("wakeup cycles:\tprocs\tno sleeper\tone sleeper\n");
+	for (int n = 16; n <= 1024; n <<= 2) {
+		for (; nr < n; nr++) {
+			if ((p = newproc()) == 0)
+				panic("wakeup_bench");
+			release(&p->lock);
+			if (sleeper == 0)
+				sleeper = p;
+		}
+		printk("\t%d\t%lu\t%lu\n", n, wakeup_bench_one(&ticks, 0),
+			   wakeup_bench_one(&ticks, sleeper));
 	}
 }
+#endif
 
 // Kill the process with the given pid.
 // The victim won't exit until it tries to return
 // to user space (see usertrap() in trap.c).
 int kill(int pid) {
-	struct proc *p;
+	struct proc	 *p;
+	struct waitq *wq;
+	void		 *chan;
 
-	for (p = proc; p < &proc[NPROC]; p++) {
+	for_each_proc(p) {
+		// procs are never freed, so skip the others without locking.
+		if (__atomic_load_n(&p->pid, __ATOMIC_RELAXED) != pid)
+			continue;
 		acquire(&p->lock);
 		if (p->pid == pid) {
 			p->killed = 1;
-			if (p->state == SLEEPING) {
-				// Wake process from sleep().
-				p->state = RUNNABLE;
+			// Wake process from sleep(). The queue lock goes
+			// before p->lock, so look again once holding both.
+			while (p->state == SLEEPING) {
+				chan = p->chan;
+				release(&p->lock);
+				wq = waitq_of(chan);
+				acquire(&wq->lock);
+				acquire(&p->lock);
+				if (p->state == SLEEPING && p->chan == chan)
+					waitq_wake(wq, p);
+				release(&wq->lock);
 			}
 			release(&p->lock);
 			return 0;
@@ -594,14 +983,25 @@ void procdump(void) {
 	char		 *state;
 
 	printk("\n");
-	for (p = proc; p < &proc[NPROC]; p++) {
+	for_each_proc(p) {
 		if (p->state == UNUSED)
 			continue;
 		if (p->state >= 0 && p->state < NELEM(states) && states[p->state])
 			state = states[p->state];
 		else
 			state = "???";
-		printk("%d %s %s", p->pid, state, p->name);
+		printk("%d %s %s minflt %lu", p->pid, state, p->name, p->min_flt);
 		printk("\n");
 	}
+	for (int i = 0; i < cpu_num(); i++)
+		printk("cpu %d: runqueue %d switches %lu steals %lu\n", i,
+			   cpus[i].nr_running, cpus[i].nr_switches, cpus[i].nr_steals);
+	for (int nid = 0; nid < MAX_NUMA_NODE; nid++) {
+		if (numa_migrations[nid].in == 0 && numa_migrations[nid].out == 0)
+			continue;
+		printk("node %d: migrations in %lu out %lu off-home %lu\n", nid,
+			   numa_migrations[nid].in, numa_migrations[nid].out,
+			   numa_migrations[nid].off_home);
+	}
+	lockstat_dump();
 }
@@ -0,0 +1,197 @@
+// Read-copy-update.
+//
+// Readers run between rcu_read_lock() and rcu_read_unlock() with
+// interrupts off, so they are neither preempted nor sleep, and a cpu
+// that gets to scheduler() or idles has left all of its read
+// sections: it passed a quiescent state. A grace period is over once
+// every cpu has passed one since the grace period started; callbacks
+// queued by call_rcu() before it started can then run, no reader can
+// still see the object they free. Idle cpus are not waited for.
+//
+// This is the minimal version: one grace period at a time, and one
+// global state, only taken by call_rcu() and by cpus that have a
+// quiescent state to report or callbacks to move along.
+
+#include "rcu.h"
+#include "device_tree.h"
+#include "kernel.h"
+#include "riscv.h"
+#include "spinlock.h"
+#include "types.h"
+
+// singly linked callback list, tail points at the last next pointer.
+struct rcu_list {
+	struct rcu_head	 *head;
+	struct rcu_head **tail;
+};
+
+static struct {
+	struct spinlock lock;
+	uint64_t		gp;		   // last grace period started
+	uint64_t		completed; // last grace period over
+	uint64_t		qs_mask;   // cpus yet to pass a quiescent state in gp
+	uint64_t		idle;	   // cpus in rcu_idle_enter(), not waited for
+	struct rcu_list next;	   // callbacks without a grace period yet
+	struct rcu_list wait;	   // callbacks waiting for grace period wait_gp
+	uint64_t		wait_gp;
+} rcu;
+
+static inline void rcu_list_init(struct rcu_list *l) {
+	l->head = 0;
+	l->tail = &l->head;
+}
+
+// Move all callbacks of from to the end of to.
+static inline void rcu_list_splice(struct rcu_list *from, struct rcu_list *to) {
+	if (from->head == 0)
+		return;
+	*to->tail = from->head;
+	to->tail  = from->tail;
+	rcu_list_init(from);
+}
+
+void rcuinit(void) {
+	initlock(&rcu.lock, "rcu");
+	rcu_list_init(&rcu.next);
+	rcu_list_init(&rcu.wait);
+}
+
+// Give the callbacks of next a grace period, starting one if there
+// is none going on. Caller must hold rcu.lock.
+static void rcu_start_gp(void) {
+	if (rcu.wait.head == 0 && rcu.next.head) {
+		rcu_list_splice(&rcu.next, &rcu.wait);
+		rcu.wait_gp = rcu.gp + 1; // one that starts after now
+	}
+	if (rcu.gp != rcu.completed || rcu.wait.head == 0 ||
+		rcu.wait_gp <= rcu.gp)
+		return;
+
+	rcu.gp++;
+	rcu.qs_mask = ((1UL << cpu_num()) - 1) & ~rcu.idle;
+	if (rcu.qs_mask == 0)
+		rcu.completed = rcu.gp;
+}
+
+// Report a quiescent state of this cpu, and move the callbacks
+// along. Returns the callbacks whose grace period is over.
+// Caller must hold rcu.lock.
+static struct rcu_head *rcu_report_qs(void) {
+	struct rcu_list done;
+
+	rcu_list_init(&done);
+	rcu.qs_mask &= ~(1UL << cpu_id());
+	for (;;) {
+		if (rcu.qs_mask == 0)
+			rcu.completed = rcu.gp;
+		if (rcu.wait.head == 0 || rcu.completed < rcu.wait_gp)
+			break;
+		rcu_list_splice(&rcu.wait, &done);
+		rcu_start_gp();
+	}
+	rcu_start_gp();
+	return done.head;
+}
+
+static void rcu_run(struct rcu_head *head) {
+	struct rcu_head *next;
+
+	for (; head; head = next) {
+		next = head->next;
+		head->fn(head);
+	}
+}
+
+// This cpu is outside of any read section, called by scheduler()
+// and by idle cpus.
+void rcu_qs(void) {
+	uint64_t		 me = 1UL << cpu_id();
+	struct rcu_head *done;
+
+	// nothing to do unless we are waited for, or no grace period
+	// is going on and callbacks are ready or wait for one.
+	if (!(__atomic_load_n(&rcu.qs_mask, __ATOMIC_RELAXED) & me) &&
+		(__atomic_load_n(&rcu.gp, __ATOMIC_RELAXED) !=
+			 __atomic_load_n(&rcu.completed, __ATOMIC_RELAXED) ||
+		 (__atomic_load_n(&rcu.wait.head, __ATOMIC_RELAXED) == 0 &&
+		  __atomic_load_n(&rcu.next.head, __ATOMIC_RELAXED) == 0)))
+		return;
+
+	push_off();
+	acquire(&rcu.lock);
+	done = rcu_report_qs();
+	release(&rcu.lock);
+	pop_off();
+
+	rcu_run(done);
+}
+
+// This cpu goes idle: it is quiescent until rcu_idle_exit(), so grace
+// periods do not wait for it. Its ready callbacks run now, an idle
+// cpu may not get to them for a long time.
+void rcu_idle_enter(void) {
+	struct rcu_head *done;
+
+	push_off();
+	acquire(&rcu.lock);
+	rcu.idle |= 1UL << cpu_id();
+	done = rcu_report_qs();
+	release(&rcu.lock);
+	pop_off();
+
+	rcu_run(done);
+}
+
+void rcu_idle_exit(void) {
+	push_off();
+	acquire(&rcu.lock);
+	rcu.idle &= ~(1UL << cpu_id());
+	release(&rcu.lock);
+	pop_off();
+}
+
+// Call fn(head) once all read sections going on now are over.
+// fn runs on the cpu that ends the grace period, with no locks held.
+void call_rcu(struct rcu_head *head, void (*fn)(struct rcu_head *)) {
+	head->fn   = fn;
+	head->next = 0;
+
+	push_off();
+	acquire(&rcu.lock);
+	*rcu.next.tail = head;
+	rcu.next.tail  = &head->next;
+	rcu_start_gp();
+	release(&rcu.lock);
+	pop_off();
+}
+
+struct rcu_synchronize {
+	struct rcu_head	head;
+	struct spinlock lock;
+	int				done;
+};
+
+static void wakeme_after_rcu(struct rcu_head *head) {
+	struct rcu_synchronize *rs =
+		container_of(head, struct rcu_synchronize, head);
+
+	acquire(&rs->lock);
+	rs->done = 1;
+	wakeup(rs);
+	release(&rs->lock);
+}
+
+// Wait until all read sections going on now are over.
+// Sleeps, so it must not be called in a read section.
+void synchronize_rcu(void) {
+	struct rcu_synchronize rs;
+
+	initlock(&rs.lock, "rcu_sync");
+	rs.done = 0;
+	call_rcu(&rs.head, wakeme_after_rcu);
+
+	acquire(&rs.lock);
+	while (!rs.done)
+		sleep(&rs, &rs.lock);
+	release(&rs.lock);
+}
@@ -1,4 +1,10 @@
 // Sleeping locks
+//
+// An adaptive mutex: the lock is taken with a compare-and-swap, and
+// a waiter spins as long as the holder is running on another cpu,
+// since the lock is then likely to be released soon. Once the holder
+// is off cpu the waiter marks the lock SLEEPLOCK_WAITERS and sleeps,
+// and only a release that finds that mark takes lk and calls wakeup().
 
 #include "sleeplock.h"
 #include "kernel.h"
@@ -9,36 +15,71 @@
 #include "spinlock.h"
 #include "types.h"
 
+#define SLEEPLOCK_SPIN 10000 // max tries while spinning on a running holder
+
 void init_sleeplock(struct sleeplock *lk, char *name) {
 	initlock(&lk->lk, "sleep lock");
 	lk->name   = name;
 	lk->locked = 0;
-	lk->pid	   = 0;
+	lk->owner  = 0;
+}
+
+static inline int try_sleep_lock(struct sleeplock *lk) {
+	uint free = 0;
+
+	return __atomic_compare_exchange_n(&lk->locked, &free, SLEEPLOCK_HELD, 0,
+									   __ATOMIC_ACQUIRE, __ATOMIC_RELAXED);
+}
+
+// Spin while lk is held by a proc running on another cpu.
+// Procs are never freed, so the holder can be looked at without
+// a lock. Returns 1 if lk was taken.
+static int spin_on_owner(struct sleeplock *lk) {
+	struct proc *owner;
+
+	for (int i = 0; i < SLEEPLOCK_SPIN; i++) {
+		if (__atomic_load_n(&lk->locked, __ATOMIC_RELAXED) == 0) {
+			if (try_sleep_lock(lk))
+				return 1;
+			continue;
+		}
+		owner = __atomic_load_n(&lk->owner, __ATOMIC_RELAXED);
+		// owner is 0 for a moment after the lock is taken.
+		if (owner && __atomic_load_n(&owner->state, __ATOMIC_RELAXED) != RUNNING)
+			return 0;
+	}
+	return 0;
 }
 
 void acquire_sleep(struct sleeplock *lk) {
-	acquire(&lk->lk);
-	while (lk->locked) {
-		sleep(lk, &lk->lk);
+	if (!try_sleep_lock(lk) && !spin_on_owner(lk)) {
+		// Sleep until the lock is free. Once a waiter has marked the
+		// lock, it keeps the mark when it gets the lock, since there
+		// may be other sleepers.
+		acquire(&lk->lk);
+		while (__atomic_exchange_n(&lk->locked, SLEEPLOCK_WAITERS,
+								   __ATOMIC_ACQUIRE) != 0)
+			sleep(lk, &lk->lk);
+		release(&lk->lk);
 	}
-	lk->locked = 1;
-	lk->pid	   = this_proc()->pid;
-	release(&lk->lk);
+	__atomic_store_n(&lk->owner, this_proc(), __ATOMIC_RELAXED);
 }
 
 void release_sleep(struct sleeplock *lk) {
-	acquire(&lk->lk);
-	lk->locked = 0;
-	lk->pid	   = 0;
-	wakeup(lk);
-	release(&lk->lk);
+	__atomic_store_n(&lk->owner, 0, __ATOMIC_RELAXED);
+	if (__atomic_exchange_n(&lk->locked, 0, __ATOMIC_RELEASE) ==
+		SLEEPLOCK_WAITERS) {
+		// A sleeper set the mark holding lk, and checks the lock
+		// again before it sleeps, so taking lk here wakes it for sure.
+		acquire(&lk->lk);
+		wakeup(lk);
+		release(&lk->lk);
+	}
 }
 
+// Only the holder sets owner to itself, so no lock is needed to
+// see whether the caller holds lk.
 int holding_sleep(struct sleeplock *lk) {
-	int r;
-
-	acquire(&lk->lk);
-	r = lk->locked && (lk->pid == this_proc()->pid);
-	release(&lk->lk);
-	return r;
+	return __atomic_load_n(&lk->locked, __ATOMIC_RELAXED) &&
+		   __atomic_load_n(&lk->owner, __ATOMIC_RELAXED) == this_proc();
 }
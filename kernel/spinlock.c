@@ -1,6 +1,7 @@
 // Mutual exclusion spin locks.
 
 #include "spinlock.h"
+#include "device_tree.h"
 #include "kernel.h"
 #include "memlayout.h"
 #include "param.h"
@@ -8,38 +9,137 @@
 #include "riscv.h"
 #include "types.h"
 
+#ifdef CONFIG_LOCK_STAT
+// Lock statistics, per lock name: locks of the same name, e.g. all
+// "proc" locks, share one lockstat class. The counters are per cpu
+// and updated with the lock held, so they need no atomics and add no
+// shared cache lines to acquire().
+#define LOCKSTAT_CLASSES 128 // lock names tracked, the rest share class 0
+#define LOCKSTAT_TOP 16		 // classes shown by lockstat_dump()
+#define LOCK_NAME_MAX 32
+
+struct lock_stat {
+	uint64_t acquires;
+	uint64_t contended; // acquires that had to wait
+	uint64_t wait;		// r_time() ticks spent waiting
+};
+
+static char			   *lock_class_names[LOCKSTAT_CLASSES];
+static struct lock_stat lock_stats[MAX_CPU][LOCKSTAT_CLASSES];
+
+// The class of locks named name, taken without a lock since
+// initlock() is used to set up the locks themselves.
+static uint lock_class_of(char *name) {
+	char *n;
+
+	if (name == 0)
+		return 0;
+	for (uint i = 1; i < LOCKSTAT_CLASSES; i++) {
+		n = __atomic_load_n(&lock_class_names[i], __ATOMIC_ACQUIRE);
+		if (n == 0 &&
+			__sync_bool_compare_and_swap(&lock_class_names[i], 0, name))
+			return i;
+		n = __atomic_load_n(&lock_class_names[i], __ATOMIC_ACQUIRE);
+		if (n == name || strncmp(n, name, LOCK_NAME_MAX) == 0)
+			return i;
+	}
+	return 0;
+}
+
+// Count an acquire of lk, which waited since start if it is not 0.
+// Interrupts must be off.
+static inline void lock_stat_account(struct spinlock *lk, uint64_t start) {
+	struct lock_stat *st = &lock_stats[cpu_id()][lk->class];
+
+	st->acquires++;
+	if (start) {
+		st->contended++;
+		st->wait += r_time() - start;
+	}
+}
+
+static uint64_t lock_stat_sum(uint class, int field) {
+	uint64_t sum = 0;
+
+	for (int i = 0; i < MAX_CPU; i++) {
+		struct lock_stat *st = &lock_stats[i][class];
+
+		sum += field == 0 ? st->acquires : field == 1 ? st->contended : st->wait;
+	}
+	return sum;
+}
+
+// Print the LOCKSTAT_TOP lock classes with the most time spent
+// waiting for them, summed over all cpus.
+void lockstat_dump(void) {
+	uint64_t shown[LOCKSTAT_CLASSES / 64] = {0};
+	uint64_t wait, best_wait;
+	int		 best;
+
+	printk("lockstat:\tname\tacquires\tcontended\twait\n");
+	for (int k = 0; k < LOCKSTAT_TOP; k++) {
+		best	  = -1;
+		best_wait = 0;
+		for (int i = 0; i < LOCKSTAT_CLASSES; i++) {
+			if (shown[i / 64] & (1UL << (i % 64)))
+				continue;
+			if ((wait = lock_stat_sum(i, 2)) > best_wait ||
+				(best < 0 && lock_stat_sum(i, 0) > 0)) {
+				best	  = i;
+				best_wait = wait;
+			}
+		}
+		if (best < 0)
+			break;
+		shown[best / 64] |= 1UL << (best % 64);
+		printk("\t%s\t%lu\t%lu\t%lu\n",
+			   lock_class_names[best] ? lock_class_names[best] : "?",
+			   lock_stat_sum(best, 0), lock_stat_sum(best, 1), best_wait);
+	}
+}
+#else
+void lockstat_dump(void) {}
+#endif
+
 void initlock(struct spinlock *lk, char *name) {
-	lk->name   = name;
-	lk->locked = 0; // indicating that the lock is initially not held
-	lk->cpu	   = 0; // indicating that no processor currently holds the lock
+	lk->name  = name;
+	lk->next  = 0; // indicating that the lock is initially not held
+	lk->owner = 0;
+	lk->cpu	  = 0; // indicating that no processor currently holds the lock
+#ifdef CONFIG_LOCK_STAT
+	lk->class = lock_class_of(name);
+#endif
 }
 
 // Acquire the lock.
-// Loops (spins) until the lock is acquired.
+// Takes a ticket and spins until the lock gets to it, so waiting
+// cpus get the lock in turn and only read its line while waiting.
 void acquire(struct spinlock *lk) {
+	uint	 ticket;
+	uint64_t start = 0;
+
 	push_off(); // disable interrupts to avoid deadlock.
 	if (holding(lk))
 		panic("acquire");
 
-	// _sync_lock_test_and_set() is a built-in function that
-	// provides an atomic memory operation to set a lock and
-	// return the previous value of the lock atomically.
-	//
-	// On RISC-V, sync_lock_test_and_set turns into an atomic swap:
-	//   a5 = 1
-	//   s1 = &lk->locked
-	//   amoswap.w.aq a5, a5, (s1)
-	while (__sync_lock_test_and_set(&lk->locked, 1) != 0)
-		;
-
-	// Tell the C compiler and the processor to not move loads or stores
-	// past this point, to ensure that the critical section's memory
-	// references happen strictly after the lock is acquired.
-	// On RISC-V, this emits a fence instruction.
-	__sync_synchronize();
+	// On RISC-V, this turns into an amoadd.w.
+	ticket = __atomic_fetch_add(&lk->next, 1, __ATOMIC_RELAXED);
+
+	// The acquire loads tell the C compiler and the processor to not
+	// move loads or stores of the critical section before them.
+	if (__atomic_load_n(&lk->owner, __ATOMIC_ACQUIRE) != ticket) {
+		start = r_time();
+		while (__atomic_load_n(&lk->owner, __ATOMIC_ACQUIRE) != ticket)
+			;
+	}
 
 	// Record info about lock acquisition for holding() and debugging.
 	lk->cpu = this_cpu();
+#ifdef CONFIG_LOCK_STAT
+	lock_stat_account(lk, start);
+#else
+	(void)start;
+#endif
 }
 
 // Release the lock.
@@ -49,22 +149,11 @@ void release(struct spinlock *lk) {
 
 	lk->cpu = 0;
 
-	// Tell the C compiler and the CPU to not move loads or stores
-	// past this point, to ensure that all the stores in the critical
-	// section are visible to other CPUs before the lock is released,
-	// and that loads in the critical section occur strictly before
-	// the lock is released.
-	// On RISC-V, this emits a fence instruction.
-	__sync_synchronize();
-
-	// Release the lock, equivalent to lk->locked = 0.
-	// This code doesn't use a C assignment, since the C standard
-	// implies that an assignment might be implemented with
-	// multiple store instructions.
-	// On RISC-V, sync_lock_release turns into an atomic swap:
-	//   s1 = &lk->locked
-	//   amoswap.w zero, zero, (s1)
-	__sync_lock_release(&lk->locked);
+	// Hand the lock to the next ticket. The release store makes all
+	// the stores of the critical section visible to other CPUs before
+	// the lock is handed over, and keeps its loads before it.
+	// Only the holder writes owner, so a plain increment is enough.
+	__atomic_store_n(&lk->owner, lk->owner + 1, __ATOMIC_RELEASE);
 
 	pop_off();
 }
@@ -72,7 +161,82 @@ void release(struct spinlock *lk) {
 // Check whether this cpu is holding the lock.
 // Interrupts must be off.
 int holding(struct spinlock *lk) {
-	return (lk->locked && lk->cpu == this_cpu());
+	return (__atomic_load_n(&lk->owner, __ATOMIC_RELAXED) !=
+				__atomic_load_n(&lk->next, __ATOMIC_RELAXED) &&
+			lk->cpu == this_cpu());
+}
+
+// Reader-writer locks
+
+#define RW_WRITER (1U << 31)		// a writer holds the lock
+#define RW_WRITER_WAITING (1U << 30) // a writer waits, readers keep out
+
+void rwlock_init(rwlock_t *lk, char *name) {
+	lk->cnt	 = 0;
+	lk->name = name;
+}
+
+void read_lock(rwlock_t *lk) {
+	uint cnt;
+
+	push_off(); // disable interrupts to avoid deadlock.
+	for (;;) {
+		cnt = __atomic_load_n(&lk->cnt, __ATOMIC_RELAXED);
+		if ((cnt & (RW_WRITER | RW_WRITER_WAITING)) == 0 &&
+			__atomic_compare_exchange_n(&lk->cnt, &cnt, cnt + 1, 0,
+										__ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+			return;
+	}
+}
+
+void read_unlock(rwlock_t *lk) {
+	__atomic_fetch_sub(&lk->cnt, 1, __ATOMIC_RELEASE);
+	pop_off();
+}
+
+void write_lock(rwlock_t *lk) {
+	uint cnt;
+
+	push_off(); // disable interrupts to avoid deadlock.
+	for (;;) {
+		cnt = __atomic_load_n(&lk->cnt, __ATOMIC_RELAXED);
+		// take it once the readers are gone; the waiting bit of
+		// other writers is dropped and set again by them.
+		if ((cnt & ~RW_WRITER_WAITING) == 0) {
+			if (__atomic_compare_exchange_n(&lk->cnt, &cnt, RW_WRITER, 0,
+											__ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+				return;
+		}
+		else if ((cnt & RW_WRITER_WAITING) == 0) {
+			__atomic_fetch_or(&lk->cnt, RW_WRITER_WAITING, __ATOMIC_RELAXED);
+		}
+	}
+}
+
+void write_unlock(rwlock_t *lk) {
+	if (!(lk->cnt & RW_WRITER))
+		panic("write_unlock");
+	__atomic_fetch_and(&lk->cnt, ~RW_WRITER, __ATOMIC_RELEASE);
+	pop_off();
+}
+
+// Sequence locks
+
+void seqlock_init(seqlock_t *sl, char *name) {
+	sl->seq = 0;
+	initlock(&sl->lock, name);
+}
+
+void write_seqlock(seqlock_t *sl) {
+	acquire(&sl->lock);
+	__atomic_store_n(&sl->seq, sl->seq + 1, __ATOMIC_RELAXED);
+	// the odd sequence must be visible before any of the data writes.
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+void write_sequnlock(seqlock_t *sl) {
+	__atomic_store_n(&sl->seq, sl->seq + 1, __ATOMIC_RELEASE);
+	release(&sl->lock);
 }
 
 // push_off/pop_off are like intr_off()/intr_on() except that they are matched:
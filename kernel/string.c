@@ -1,55 +1,226 @@
+#include "device_tree.h"
+#include "kernel.h"
+#include "riscv.h"
+#include "spinlock.h"
 #include "types.h"
 
-void *memset(void *dst, int c, uint n) {
-	char *cdst = (char *)dst;
-	int	  i;
-	for (i = 0; i < n; i++) {
-		cdst[i] = c;
+// memset/memmove/memcmp work a 64-bit word at a time once the pointers
+// are aligned, and switch to the vector versions in string_rvv.S for
+// large sizes if every hart implements the V extension.
+
+typedef uint64_t __attribute__((may_alias)) word_t;
+
+#define WSIZE sizeof(word_t)
+#define WMASK (WSIZE - 1)
+#define RVV_THRESHOLD 256 // smaller sizes don't pay off the vector setup
+
+static int use_rvv;
+
+void *memset_word(void *dst, int c, uint n) {
+	uchar  *d = dst;
+	word_t	w = (uchar)c;
+
+	for (; n > 0 && ((uint64_t)d & WMASK); n--)
+		*d++ = c;
+
+	w |= w << 8;
+	w |= w << 16;
+	w |= w << 32;
+	for (; n >= 8 * WSIZE; n -= 8 * WSIZE, d += 8 * WSIZE) {
+		((word_t *)d)[0] = w;
+		((word_t *)d)[1] = w;
+		((word_t *)d)[2] = w;
+		((word_t *)d)[3] = w;
+		((word_t *)d)[4] = w;
+		((word_t *)d)[5] = w;
+		((word_t *)d)[6] = w;
+		((word_t *)d)[7] = w;
 	}
+	for (; n >= WSIZE; n -= WSIZE, d += WSIZE)
+		*(word_t *)d = w;
+
+	while (n-- > 0)
+		*d++ = c;
 	return dst;
 }
 
-int memcmp(const void *v1, const void *v2, uint n) {
-	const uchar *s1, *s2;
+int memcmp_word(const void *v1, const void *v2, uint n) {
+	const uchar *s1 = v1, *s2 = v2;
 
-	s1 = v1;
-	s2 = v2;
-	while (n-- > 0) {
+	// compare words if both can be aligned, and find the differing
+	// byte of the first differing word below.
+	if ((((uint64_t)s1 ^ (uint64_t)s2) & WMASK) == 0) {
+		for (; n > 0 && ((uint64_t)s1 & WMASK); n--, s1++, s2++) {
+			if (*s1 != *s2)
+				return *s1 - *s2;
+		}
+		for (; n >= WSIZE; n -= WSIZE, s1 += WSIZE, s2 += WSIZE) {
+			if (*(word_t *)s1 != *(word_t *)s2)
+				break;
+		}
+	}
+
+	for (; n > 0; n--, s1++, s2++) {
 		if (*s1 != *s2)
 			return *s1 - *s2;
-		s1++, s2++;
 	}
-
 	return 0;
 }
 
-void *memmove(void *dst, const void *src, uint n) {
-	const char *s;
-	char		 *d;
+// copy forward, dst must not be above an overlapping src.
+static void copy_forward(uchar *d, const uchar *s, uint n) {
+	if ((((uint64_t)d ^ (uint64_t)s) & WMASK) == 0) {
+		for (; n > 0 && ((uint64_t)d & WMASK); n--)
+			*d++ = *s++;
+		for (; n >= 4 * WSIZE; n -= 4 * WSIZE, d += 4 * WSIZE, s += 4 * WSIZE) {
+			word_t w0 = ((word_t *)s)[0], w1 = ((word_t *)s)[1];
+			word_t w2 = ((word_t *)s)[2], w3 = ((word_t *)s)[3];
 
-	if (n == 0)
-		return dst;
+			((word_t *)d)[0] = w0;
+			((word_t *)d)[1] = w1;
+			((word_t *)d)[2] = w2;
+			((word_t *)d)[3] = w3;
+		}
+		for (; n >= WSIZE; n -= WSIZE, d += WSIZE, s += WSIZE)
+			*(word_t *)d = *(word_t *)s;
+	}
+	while (n-- > 0)
+		*d++ = *s++;
+}
 
-	s = src;
-	d = dst;
-	if (s < d && s + n > d) {
-		s += n;
-		d += n;
-		while (n-- > 0)
+// copy backward from the ends, dst must not be below an overlapping src.
+static void copy_backward(uchar *d, const uchar *s, uint n) {
+	d += n;
+	s += n;
+	if ((((uint64_t)d ^ (uint64_t)s) & WMASK) == 0) {
+		for (; n > 0 && ((uint64_t)d & WMASK); n--)
 			*--d = *--s;
+		for (; n >= 4 * WSIZE; n -= 4 * WSIZE) {
+			d -= 4 * WSIZE;
+			s -= 4 * WSIZE;
+			word_t w3 = ((word_t *)s)[3], w2 = ((word_t *)s)[2];
+			word_t w1 = ((word_t *)s)[1], w0 = ((word_t *)s)[0];
+
+			((word_t *)d)[3] = w3;
+			((word_t *)d)[2] = w2;
+			((word_t *)d)[1] = w1;
+			((word_t *)d)[0] = w0;
+		}
+		for (; n >= WSIZE; n -= WSIZE) {
+			d -= WSIZE;
+			s -= WSIZE;
+			*(word_t *)d = *(word_t *)s;
+		}
 	}
-	else
-		while (n-- > 0)
-			*d++ = *s++;
+	while (n-- > 0)
+		*--d = *--s;
+}
+
+void *memmove_word(void *dst, const void *src, uint n) {
+	const uchar *s = src;
+	uchar		  *d = dst;
 
+	if (s < d && s + n > d)
+		copy_backward(d, s, n);
+	else
+		copy_forward(d, s, n);
 	return dst;
 }
 
+#ifdef CONFIG_RISCV_ISA_V
+// The vector registers are not saved on a context switch, and user
+// procs run with the vector unit off, so the kernel only turns it on
+// around an rvv routine, with interrupts off so it can't be preempted
+// or trapped into from half-way.
+static inline void kernel_vector_begin(void) {
+	push_off();
+	w_sstatus(r_sstatus() | SSTATUS_VS_INITIAL);
+}
+
+static inline void kernel_vector_end(void) {
+	w_sstatus(r_sstatus() & ~SSTATUS_VS);
+	pop_off();
+}
+#endif
+
+void *memset(void *dst, int c, uint n) {
+#ifdef CONFIG_RISCV_ISA_V
+	if (use_rvv && n >= RVV_THRESHOLD) {
+		kernel_vector_begin();
+		memset_rvv(dst, c, n);
+		kernel_vector_end();
+		return dst;
+	}
+#endif
+	return memset_word(dst, c, n);
+}
+
+int memcmp(const void *v1, const void *v2, uint n) {
+#ifdef CONFIG_RISCV_ISA_V
+	if (use_rvv && n >= RVV_THRESHOLD) {
+		int r;
+
+		kernel_vector_begin();
+		r = memcmp_rvv(v1, v2, n);
+		kernel_vector_end();
+		return r;
+	}
+#endif
+	return memcmp_word(v1, v2, n);
+}
+
+void *memmove(void *dst, const void *src, uint n) {
+#ifdef CONFIG_RISCV_ISA_V
+	// the vector copy runs forward only.
+	if (use_rvv && n >= RVV_THRESHOLD &&
+		!((char *)src < (char *)dst && (char *)src + n > (char *)dst)) {
+		kernel_vector_begin();
+		memcpy_rvv(dst, src, n);
+		kernel_vector_end();
+		return dst;
+	}
+#endif
+	return memmove_word(dst, src, n);
+}
+
 // memcpy exists to placate GCC.  Use memmove.
 void *memcpy(void *dst, const void *src, uint n) {
 	return memmove(dst, src, n);
 }
 
+#ifdef CONFIG_RISCV_ISA_V
+// whether the single-letter extensions of a riscv,isa string
+// like "rv64imafdcv_zicsr" include ext.
+static int isa_has_ext(const char *isa, char ext) {
+	if (strncmp(isa, "rv64", 4) != 0 && strncmp(isa, "rv32", 4) != 0)
+		return 0;
+	for (isa += 4; *isa && *isa != '_'; isa++) {
+		if (*isa == ext)
+			return 1;
+	}
+	return 0;
+}
+#endif
+
+// Pick the mem* implementations, after the device tree is parsed.
+void string_init(void) {
+#ifdef CONFIG_RISCV_ISA_V
+	cpu_info *cpu;
+	int		  id;
+
+	use_rvv = cpu_num() > 0;
+	for_each_cpu(id, cpu) {
+		if (!isa_has_ext(cpu->riscv_isa, 'v'))
+			use_rvv = 0;
+	}
+#endif
+	pr_info("string: using %s mem* routines", use_rvv ? "rvv" : "word");
+}
+
+// Turn off the vector unit of this hart, whatever the firmware left
+// it at: it is only on inside kernel_vector_begin/end().
+void string_init_hart(void) { w_sstatus(r_sstatus() & ~SSTATUS_VS); }
+
 int strncmp(const char *p, const char *q, uint n) {
 	while (n > 0 && *p && *p == *q)
 		n--, p++, q++;
@@ -89,3 +260,81 @@ int strlen(const char *s) {
 		;
 	return n;
 }
+
+#ifdef CONFIG_STRING_BENCH
+#include "mm.h"
+
+#define BENCH_BYTES (1 << 20) // bytes processed per measurement
+#define BENCH_MAX_SIZE (64 * 1024)
+
+typedef void *(*bench_fn)(void *, const void *, uint);
+
+static void *bench_memset_word(void *d, const void *s, uint n) {
+	return memset_word(d, 0, n);
+}
+static void *bench_memmove_word(void *d, const void *s, uint n) {
+	return memmove_word(d, s, n);
+}
+static void *bench_memcmp_word(void *d, const void *s, uint n) {
+	return (void *)(uint64_t)memcmp_word(d, s, n);
+}
+#ifdef CONFIG_RISCV_ISA_V
+static void *bench_memset_rvv(void *d, const void *s, uint n) {
+	return memset_rvv(d, 0, n);
+}
+static void *bench_memcmp_rvv(void *d, const void *s, uint n) {
+	return (void *)(uint64_t)memcmp_rvv(d, s, n);
+}
+#endif
+
+// print bytes/cycle of fn on n byte buffers, with two decimals.
+static void bench_one(bench_fn fn, char *dst, char *src, uint n) {
+	uint64_t start, cycles;
+
+	fn(dst, src, n); // warm up the cache
+	start = r_cycle();
+	for (int i = 0; i < BENCH_BYTES / n; i++)
+		fn(dst, src, n);
+	cycles = r_cycle() - start;
+	if (cycles == 0)
+		cycles = 1;
+	printk("\t%lu.%s%lu", BENCH_BYTES / cycles,
+		   BENCH_BYTES * 100 / cycles % 100 < 10 ? "0" : "",
+		   BENCH_BYTES * 100 / cycles % 100);
+}
+
+// Report bytes/cycle of the mem* routines for 64B ~ 64KB sizes.
+void string_bench(void) {
+	char *dst = alloc_pages_exact(BENCH_MAX_SIZE);
+	char *src = alloc_pages_exact(BENCH_MAX_SIZE);
+
+	if (dst == 0 || src == 0)
+		panic("string_bench");
+	memset_word(src, 0x5a, BENCH_MAX_SIZE);
+	memset_word(dst, 0x5a, BENCH_MAX_SIZE); // memcmp scans all of it
+
+	printk("mem* bytes/cycle:\tmemset\tmemmove\tmemcmp");
+	if (use_rvv)
+		printk("\tmemset(v)\tmemcpy(v)\tmemcmp(v)");
+	printk("\n");
+	for (uint n = 64; n <= BENCH_MAX_SIZE; n <<= 2) {
+		printk("%d bytes:\t", n);
+		bench_one(bench_memset_word, dst, src, n);
+		bench_one(bench_memmove_word, dst, src, n);
+		bench_one(bench_memcmp_word, dst, src, n);
+#ifdef CONFIG_RISCV_ISA_V
+		if (use_rvv) {
+			kernel_vector_begin();
+			bench_one(bench_memset_rvv, dst, src, n);
+			bench_one(memcpy_rvv, dst, src, n);
+			bench_one(bench_memcmp_rvv, dst, src, n);
+			kernel_vector_end();
+		}
+#endif
+		printk("\n");
+	}
+
+	free_pages_exact(dst, BENCH_MAX_SIZE);
+	free_pages_exact(src, BENCH_MAX_SIZE);
+}
+#endif
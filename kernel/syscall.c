@@ -80,6 +80,8 @@ extern uint64_t sys_unlink(void);
 extern uint64_t sys_link(void);
 extern uint64_t sys_mkdir(void);
 extern uint64_t sys_close(void);
+extern uint64_t sys_mmap(void);
+extern uint64_t sys_munmap(void);
 
 // An array mapping syscall numbers from syscall.h
 // to the function that handles the system call.
@@ -91,6 +93,7 @@ static uint64_t (*syscalls[])(void) = {
 	[SYS_sleep] sys_sleep, [SYS_uptime] sys_uptime, [SYS_open] sys_open,
 	[SYS_write] sys_write, [SYS_mknod] sys_mknod,	[SYS_unlink] sys_unlink,
 	[SYS_link] sys_link,   [SYS_mkdir] sys_mkdir,	[SYS_close] sys_close,
+	[SYS_mmap] sys_mmap,   [SYS_munmap] sys_munmap,
 };
 
 void syscall(void) {
@@ -281,7 +281,7 @@ fail:
 
 uint64_t sys_open(void) {
 	char		  path[MAXPATH];
-	int			  fd, omode;
+	int			  fd, omode, writable;
 	struct file	*f;
 	struct inode *ip;
 	int			  n;
@@ -318,9 +318,19 @@ uint64_t sys_open(void) {
 		return -1;
 	}
 
+	// a program being run can not be written, see deny_write_access().
+	writable = (omode & O_WRONLY) || (omode & O_RDWR);
+	if (writable && ip->type == T_FILE && get_write_access(ip) < 0) {
+		iunlockput(ip);
+		end_op();
+		return -1;
+	}
+
 	if ((f = filealloc()) == 0 || (fd = fdalloc(f)) < 0) {
 		if (f)
 			fileclose(f);
+		if (writable && ip->type == T_FILE)
+			put_write_access(ip);
 		iunlockput(ip);
 		end_op();
 		return -1;
@@ -336,7 +346,7 @@ uint64_t sys_open(void) {
 	}
 	f->ip		= ip;
 	f->readable = !(omode & O_WRONLY);
-	f->writable = (omode & O_WRONLY) || (omode & O_RDWR);
+	f->writable = writable;
 
 	if ((omode & O_TRUNC) && ip->type == T_FILE) {
 		itrunc(ip);
@@ -472,3 +482,26 @@ uint64_t sys_pipe(void) {
 	}
 	return 0;
 }
+
+uint64_t sys_mmap(void) {
+	uint64_t	 addr, len, off;
+	int			 prot, flags;
+	struct file *f = 0;
+
+	argaddr(0, &addr);
+	argaddr(1, &len);
+	argint(2, &prot);
+	argint(3, &flags);
+	argaddr(5, &off);
+	if (!(flags & MAP_ANONYMOUS) && argfd(4, 0, &f) < 0)
+		return -1;
+	return mmap(addr, len, prot, flags, f, off);
+}
+
+uint64_t sys_munmap(void) {
+	uint64_t addr, len;
+
+	argaddr(0, &addr);
+	argaddr(1, &len);
+	return munmap(addr, len);
+}
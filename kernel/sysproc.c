@@ -4,6 +4,7 @@
 #include "proc.h"
 #include "riscv.h"
 #include "spinlock.h"
+#include "timer.h"
 #include "types.h"
 
 uint64_t sys_exit(void) {
@@ -20,6 +21,9 @@ uint64_t sys_fork(void) { return fork(); }
 uint64_t sys_wait(void) {
 	uint64_t p;
 	argaddr(0, &p);
+	// wait() copies out the exit status holding wait_lock.
+	if (p != 0)
+		uvmprefault(this_proc(), p, sizeof(int));
 	return wait(p);
 }
 
@@ -34,21 +38,34 @@ uint64_t sys_sbrk(void) {
 	return addr;
 }
 
+// wake up the proc of sys_sleep(), which sleeps on its timer.
+static void sleep_timeout(struct timer_list *t) {
+	acquire(&tickslock);
+	wakeup(t);
+	release(&tickslock);
+}
+
 uint64_t sys_sleep(void) {
-	int	 n;
-	uint ticks0;
+	int				  n;
+	uint64_t		  ticks0;
+	struct timer_list timer;
 
 	argint(0, &n);
+	init_timer(&timer, sleep_timeout);
+	ticks0 = ticks_read();
 	acquire(&tickslock);
-	ticks0 = ticks;
-	while (ticks - ticks0 < n) {
+	while (ticks_read() - ticks0 < n) {
 		if (killed(this_proc())) {
 			release(&tickslock);
+			del_timer(&timer);
 			return -1;
 		}
-		sleep(&ticks, &tickslock);
+		if (!timer_pending(&timer))
+			mod_timer(&timer, ticks0 + n);
+		sleep(&timer, &tickslock);
 	}
 	release(&tickslock);
+	del_timer(&timer);
 	return 0;
 }
 
@@ -61,11 +78,4 @@ uint64_t sys_kill(void) {
 
 // return how many clock tick interrupts have occurred
 // since start.
-uint64_t sys_uptime(void) {
-	uint xticks;
-
-	acquire(&tickslock);
-	xticks = ticks;
-	release(&tickslock);
-	return xticks;
-}
+uint64_t sys_uptime(void) { return ticks_read(); }
@@ -1,31 +1,409 @@
+// Timers.
+//
+// Every cpu has a hierarchical timer wheel of tick granularity and a
+// sorted list of high resolution timers keyed on r_time(). The wheel
+// has WHEEL_DEPTH levels of WHEEL_SIZE slots, a level covering
+// WHEEL_SIZE times the range of the one below. A timer goes into the
+// slot of the lowest level that reaches its expiry, so adding and
+// deleting are O(1); the slots of a higher level are cascaded down
+// when the wheel gets to them.
+//
+// No cpu takes a periodic interrupt: each one sets its timer to its
+// next event, the earliest hrtimer or non-empty wheel slot. An idle
+// cpu with no timers takes no timer interrupts at all. ticks is caught
+// up with the clock by the timer interrupts, at least once per time
+// slice on the cpus that run procs, and read without a lock.
+
+#include "timer.h"
+#include "cpu.h"
+#include "device_tree.h"
 #include "kernel.h"
 #include "param.h"
 #include "sbi.h"
 #include "spinlock.h"
 #include "types.h"
 
-struct spinlock tickslock;
-uint			ticks;
+#define WHEEL_BITS 6
+#define WHEEL_SIZE (1 << WHEEL_BITS)
+#define WHEEL_MASK (WHEEL_SIZE - 1)
+#define WHEEL_DEPTH 4
+#define WHEEL_MAX_DELTA ((1UL << (WHEEL_BITS * WHEEL_DEPTH)) - 1)
+#define LVL_SHIFT(lvl) (WHEEL_BITS * (lvl))
+
+#define NEVER (~0UL)
+#define TIMER_OFF (~0UL) // the timer never fires
+
+struct timer_base {
+	struct spinlock	 lock;
+	uint64_t		 clk;				   // next tick to run the timers of
+	uint64_t		 pending[WHEEL_DEPTH]; // bitmaps of the non-empty slots
+	struct list_head wheel[WHEEL_DEPTH][WHEEL_SIZE];
+};
+
+struct hrtimer_base {
+	struct spinlock	 lock;
+	struct list_head active; // pending hrtimers, the soonest first
+};
+
+struct spinlock tickslock; // sleepers of sys_sleep() wait with it
+uint64_t		ticks;
+
+static seqlock_t ticks_seq; // 64-bit ticks can tear on rv32
+
+static uint64_t boot_time; // r_time() of tick 0
+
+static struct timer_base   timer_bases[MAX_CPU];
+static struct hrtimer_base hrtimer_bases[MAX_CPU];
+static struct hrtimer	   slice_timers[MAX_CPU];
+static int				   slice_expired[MAX_CPU];
+
+static void slice_end(struct hrtimer *t);
 
 void timerinit() {
 	initlock(&tickslock, "time");
+	seqlock_init(&ticks_seq, "ticks");
+	boot_time = r_time();
+
+	for (int i = 0; i < MAX_CPU; i++) {
+		initlock(&timer_bases[i].lock, "timer_base");
+		for (int lvl = 0; lvl < WHEEL_DEPTH; lvl++)
+			for (int j = 0; j < WHEEL_SIZE; j++)
+				INIT_LIST_HEAD(&timer_bases[i].wheel[lvl][j]);
+		initlock(&hrtimer_bases[i].lock, "hrtimer_base");
+		INIT_LIST_HEAD(&hrtimer_bases[i].active);
+		hrtimer_init(&slice_timers[i], slice_end);
+	}
 	pr_info("timerinit");
 }
 
-void set_next_timeout() {
-	// There is a very strange bug,
-	// if comment the `printf` line below
-	// the timer will not work.
+static inline uint64_t clock_ticks(void) {
+	return (r_time() - boot_time) / INTERVAL;
+}
+
+// Bring ticks up to date with the clock.
+void ticks_sync(void) {
+	uint64_t now = clock_ticks();
+
+	if (now <= __atomic_load_n(&ticks, __ATOMIC_RELAXED))
+		return; // another cpu got there first
+	write_seqlock(&ticks_seq);
+	if (now > ticks)
+		ticks = now;
+	write_sequnlock(&ticks_seq);
+}
+
+uint64_t ticks_read(void) {
+	uint64_t t;
+	uint	 seq;
+
+	do {
+		seq = read_seqbegin(&ticks_seq);
+		t	= ticks;
+	} while (read_seqretry(&ticks_seq, seq));
+	return t;
+}
+
+// Timer wheel
+
+// Put t into the slot of its expiry. Caller must hold base->lock.
+static void wheel_enqueue(struct timer_base *base, struct timer_list *t) {
+	uint64_t expires = t->expires, delta;
+	int		 lvl, idx;
+
+	if (expires < base->clk)
+		expires = base->clk; // already due, runs at the next tick
+	delta = expires - base->clk;
+	if (delta > WHEEL_MAX_DELTA) {
+		// comes back around and is queued again, see run_timers().
+		delta	= WHEEL_MAX_DELTA;
+		expires = base->clk + delta;
+	}
+	for (lvl = 0; lvl < WHEEL_DEPTH - 1; lvl++) {
+		if (delta < (1UL << LVL_SHIFT(lvl + 1)))
+			break;
+	}
+	idx = (expires >> LVL_SHIFT(lvl)) & WHEEL_MASK;
 
-	// this bug seems to disappear automatically
-	// printk("");
-	sbi_ecall_set_timer(r_time() + INTERVAL);
+	list_add_tail(&t->entry, &base->wheel[lvl][idx]);
+	base->pending[lvl] |= 1UL << idx;
+	t->base = base;
+	t->slot = lvl * WHEEL_SIZE + idx;
 }
 
-void timer_tick() {
-	acquire(&tickslock);
-	ticks++;
-	wakeup(&ticks);
-	release(&tickslock);
+// Caller must hold base->lock.
+static void wheel_dequeue(struct timer_base *base, struct timer_list *t) {
+	int				  lvl  = t->slot / WHEEL_SIZE, idx = t->slot % WHEEL_SIZE;
+	struct list_head *slot = &base->wheel[lvl][idx];
+
+	list_del_init(&t->entry);
+	if (list_empty(slot))
+		base->pending[lvl] &= ~(1UL << idx);
+}
+
+// Move the timers of slot idx of level lvl to the list head.
+// Caller must hold base->lock.
+static void wheel_take_slot(struct timer_base *base, int lvl, int idx,
+							struct list_head *head) {
+	list_splice_init(&base->wheel[lvl][idx], head);
+	base->pending[lvl] &= ~(1UL << idx);
+}
+
+// The tick at which the wheel first gets to a non-empty slot, the
+// earliest a pending timer can expire or must be cascaded, or NEVER.
+// Caller must hold base->lock.
+static uint64_t wheel_next(struct timer_base *base) {
+	uint64_t next = NEVER, c0, bits, mask;
+	int		 d0, first;
+
+	for (int lvl = 0; lvl < WHEEL_DEPTH; lvl++) {
+		if ((bits = base->pending[lvl]) == 0)
+			continue;
+		// the first tick at or after clk where the wheel gets to
+		// level lvl, and the slot it gets to there.
+		mask = (1UL << LVL_SHIFT(lvl)) - 1;
+		c0	 = (base->clk + mask) & ~mask;
+		d0	 = (c0 >> LVL_SHIFT(lvl)) & WHEEL_MASK;
+		// the first non-empty slot from d0 on, wrapping around.
+		bits  = (bits >> d0) | (d0 ? bits << (WHEEL_SIZE - d0) : 0);
+		first = __builtin_ctzl(bits);
+		if (c0 + ((uint64_t)first << LVL_SHIFT(lvl)) < next)
+			next = c0 + ((uint64_t)first << LVL_SHIFT(lvl));
+	}
+	return next;
+}
+
+// Cascade the slots of the upper levels the wheel gets to at clk
+// into the lower levels. Caller must hold base->lock.
+static void wheel_cascade(struct timer_base *base) {
+	struct timer_list *t, *tmp;
+	struct list_head   head;
+	int				   idx;
+
+	for (int lvl = 1; lvl < WHEEL_DEPTH; lvl++) {
+		if (base->clk & ((1UL << LVL_SHIFT(lvl)) - 1))
+			break;
+		idx = (base->clk >> LVL_SHIFT(lvl)) & WHEEL_MASK;
+		INIT_LIST_HEAD(&head);
+		wheel_take_slot(base, lvl, idx, &head);
+		list_for_each_entry_safe(t, tmp, &head, entry) {
+			list_del(&t->entry);
+			wheel_enqueue(base, t);
+		}
+	}
+}
+
+// Run the expired timers of the wheel of this cpu. Ticks without any
+// due slot are skipped, so a cpu back from a long idle period does
+// not walk every tick it missed.
+static void run_timers(struct timer_base *base) {
+	uint64_t		   now = clock_ticks(), next;
+	struct timer_list *t;
+	struct list_head   head;
+
+	acquire(&base->lock);
+	while (base->clk <= now) {
+		if ((next = wheel_next(base)) > now) {
+			base->clk = now + 1;
+			break;
+		}
+		base->clk = next;
+		wheel_cascade(base);
+
+		INIT_LIST_HEAD(&head);
+		wheel_take_slot(base, 0, base->clk & WHEEL_MASK, &head);
+		while (!list_empty(&head)) {
+			t = list_first_entry(&head, struct timer_list, entry);
+			list_del_init(&t->entry);
+			if (t->expires > base->clk) {
+				wheel_enqueue(base, t); // was too far out for the wheel
+				continue;
+			}
+			release(&base->lock);
+			t->fn(t);
+			acquire(&base->lock);
+		}
+		base->clk++;
+	}
+	release(&base->lock);
+}
+
+void init_timer(struct timer_list *t, void (*fn)(struct timer_list *)) {
+	INIT_LIST_HEAD(&t->entry);
+	t->expires = 0;
+	t->fn	   = fn;
+	t->base	   = 0;
+}
+
+int timer_pending(struct timer_list *t) { return !list_empty(&t->entry); }
+
+static void timer_program(int force);
+
+// Start t on the wheel of this cpu, it must not be pending.
+void add_timer(struct timer_list *t) {
+	struct timer_base *base;
+
+	push_off();
+	base = &timer_bases[cpu_id()];
+	acquire(&base->lock);
+	wheel_enqueue(base, t);
+	release(&base->lock);
+	timer_program(0);
+	pop_off();
+}
+
+// Stop t. Returns 1 if it was pending, 0 if it was not.
+// The function of t may still be running on another cpu.
+int del_timer(struct timer_list *t) {
+	struct timer_base *base = t->base;
+	int				   ret	= 0;
+
+	if (base == 0)
+		return 0;
+	acquire(&base->lock);
+	if (timer_pending(t)) {
+		wheel_dequeue(base, t);
+		ret = 1;
+	}
+	release(&base->lock);
+	return ret;
+}
+
+// (Re)start t to expire at tick expires, on the wheel of this cpu.
+// Returns 1 if t was pending, 0 if it was not.
+int mod_timer(struct timer_list *t, uint64_t expires) {
+	int ret = del_timer(t);
+
+	t->expires = expires;
+	add_timer(t);
+	return ret;
+}
+
+// High resolution timers
+
+void hrtimer_init(struct hrtimer *t, void (*fn)(struct hrtimer *)) {
+	INIT_LIST_HEAD(&t->entry);
+	t->expires = 0;
+	t->fn	   = fn;
+	t->base	   = 0;
+}
+
+// Stop t. Returns 1 if it was pending, 0 if it was not.
+int hrtimer_cancel(struct hrtimer *t) {
+	struct hrtimer_base *base = t->base;
+	int					 ret  = 0;
+
+	if (base == 0)
+		return 0;
+	acquire(&base->lock);
+	if (!list_empty(&t->entry)) {
+		list_del_init(&t->entry);
+		ret = 1;
+	}
+	release(&base->lock);
+	return ret;
+}
+
+// (Re)start t to expire once r_time() reaches expires, on this cpu.
+void hrtimer_start(struct hrtimer *t, uint64_t expires) {
+	struct hrtimer_base *base;
+	struct hrtimer		*pos;
+
+	hrtimer_cancel(t);
+	push_off();
+	base	   = &hrtimer_bases[cpu_id()];
+	t->expires = expires;
+	t->base	   = base;
+	acquire(&base->lock);
+	list_for_each_entry(pos, &base->active, entry) {
+		if (pos->expires > expires)
+			break;
+	}
+	list_add_tail(&t->entry, &pos->entry); // before pos
+	release(&base->lock);
+	timer_program(0);
+	pop_off();
+}
+
+// The soonest pending hrtimer, or 0. Caller must hold base->lock.
+static struct hrtimer *hrtimer_first(struct hrtimer_base *base) {
+	if (list_empty(&base->active))
+		return 0;
+	return list_first_entry(&base->active, struct hrtimer, entry);
+}
+
+static void run_hrtimers(struct hrtimer_base *base) {
+	struct hrtimer *t;
+
+	acquire(&base->lock);
+	while ((t = hrtimer_first(base)) != 0 && t->expires <= r_time()) {
+		list_del_init(&t->entry);
+		release(&base->lock);
+		t->fn(t);
+		acquire(&base->lock);
+	}
+	release(&base->lock);
+}
+
+// Scheduler time slices
+
+static void slice_end(struct hrtimer *t) { slice_expired[cpu_id()] = 1; }
+
+// Start the time slice of the proc about to run on this cpu.
+void timer_start_slice(void) {
+	push_off();
+	hrtimer_start(&slice_timers[cpu_id()], r_time() + INTERVAL);
+	pop_off();
+}
+
+// Timer interrupts
+
+// Set the timer of this cpu to its next event. Unless force is set,
+// the timer is only moved if the event is before the armed one.
+static void timer_program(int force) {
+	struct timer_base	*tb;
+	struct hrtimer_base *hb;
+	struct hrtimer		*t;
+	struct cpu			*c;
+	uint64_t			 next = TIMER_OFF, tick;
+
+	push_off();
+	c  = this_cpu();
+	tb = &timer_bases[cpu_id()];
+	hb = &hrtimer_bases[cpu_id()];
+
+	acquire(&tb->lock);
+	if ((tick = wheel_next(tb)) != NEVER)
+		next = boot_time + tick * INTERVAL;
+	release(&tb->lock);
+
+	acquire(&hb->lock);
+	t = hrtimer_first(hb);
+	if (t && t->expires < next)
+		next = t->expires;
+	release(&hb->lock);
+
+	// setting the timer also clears a pending timer interrupt.
+	if (force || next < c->timer_next) {
+		c->timer_next = next;
+		sbi_ecall_set_timer(next);
+	}
+	pop_off();
+}
+
+// Reprogram the timer of this cpu, e.g. after it fired.
+void set_next_timeout() { timer_program(1); }
+
+// Run the expired timers of this cpu, called from the timer
+// interrupt. Returns 1 if the time slice of the running proc is over.
+int timer_tick() {
+	int id = cpu_id(), expired;
+
+	ticks_sync();
+	run_hrtimers(&hrtimer_bases[id]);
+	run_timers(&timer_bases[id]);
 	set_next_timeout();
-}
\ No newline at end of file
+
+	expired			  = slice_expired[id];
+	slice_expired[id] = 0;
+	return expired;
+}
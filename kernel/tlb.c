@@ -0,0 +1,203 @@
+// Address space IDs and TLB flushing.
+// Every process runs with an ASID of its own, so its TLB entries
+// survive switching to other address spaces and back, and the
+// kernel (ASID 0) keeps its entries over traps. p->asid holds the
+// ASID together with the generation it was handed out in. When all
+// ASIDs are used up a new generation starts: the map is cleared,
+// every hart flushes its whole TLB before it next enters user
+// space, and processes holding an ASID of an old generation get a
+// new one on their way back to user space.
+// Harts with too few ASIDs run everything with ASID 0, and
+// trampoline.S flushes the TLB on every switch of page tables.
+//
+// After PTEs of a process were changed, the harts in p->tlb_cpus
+// may still cache the old ones. The changed pages are gathered in a
+// struct tlb_batch, and one SBI remote fence per batch reaches all
+// those harts at once.
+
+#include "kernel.h"
+#include "bitmap.h"
+#include "math.h"
+#include "proc.h"
+#include "riscv.h"
+#include "sbi.h"
+#include "spinlock.h"
+
+#define MAX_ASIDS (1 << 16)
+// flush larger batches by ASID instead of page by page
+#define TLB_FLUSH_MAX_PAGES 32
+
+static struct spinlock asid_lock;
+static uint64_t		   asid_map[BIT_WORD(MAX_ASIDS)]; // used in this generation
+static uint64_t		   asid_generation; // multiple of nr_asids
+static uint64_t		   asid_next;		// where to look for a free one
+static uint64_t		   nr_asids;
+static int			   use_asids;
+static int			   asid_flush_pending[MAX_CPU];
+static int			   has_rfence; // SBI RFENCE extension is there
+
+// Find out how many ASIDs the hart implements, by writing all ones
+// to the ASID field of satp, must be called with paging on.
+void asid_init(void) {
+	uint64_t satp = r_satp();
+
+	initlock(&asid_lock, "asid");
+
+	w_satp(satp | SATP_ASID_MASK);
+	nr_asids = ((r_satp() & SATP_ASID_MASK) >> SATP_ASID_SHIFT) + 1;
+	w_satp(satp);
+	sfence_vma();
+
+	// with no more ASIDs than harts, rollovers would never end.
+	use_asids		= nr_asids > 2 * cpu_num();
+	asid_generation = nr_asids;
+	asid_next		= 1;
+	bitmap_set(asid_map, 0); // the kernel's
+
+	// a fence on no harts at all only tells if the call is there.
+	has_rfence = sbi_ecall_remote_sfence_vma_asid(0, 0, -1UL, 0) == SBI_SUCCESS;
+
+	pr_info("asid: %lu ASIDs%s, remote fence %s", nr_asids,
+			use_asids ? "" : " (not used)", has_rfence ? "on" : "off");
+}
+
+// Hand p a free ASID of the current generation, starting a new
+// generation if there is none left. Caller must hold asid_lock.
+static void asid_new(struct proc *p) {
+	uint64_t asid;
+
+	asid = bitmap_find_next_zero(asid_map, nr_asids, asid_next);
+	if (asid == nr_asids)
+		asid = bitmap_find_next_zero(asid_map, nr_asids, 1);
+	if (asid == nr_asids) {
+		asid_generation += nr_asids;
+		memset(asid_map, 0, sizeof(asid_map));
+		bitmap_set(asid_map, 0);
+		for (int i = 0; i < cpu_num(); i++)
+			asid_flush_pending[i] = 1;
+		asid = 1;
+	}
+
+	bitmap_set(asid_map, asid);
+	asid_next	= asid + 1;
+	p->asid		= asid_generation | asid;
+	p->tlb_cpus = 0;
+}
+
+static inline uint64_t asid_of(struct proc *p) {
+	return use_asids ? p->asid & (nr_asids - 1) : 0;
+}
+
+// The satp to run p in user space with, allocating an ASID if p
+// has none of the current generation. Called with interrupts off
+// on the way back to user space.
+uint64_t proc_satp(struct proc *p) {
+	int cpu = cpu_id();
+
+	if (!use_asids)
+		return MAKE_SATP(p->pagetable);
+
+	if ((p->asid & ~(nr_asids - 1)) !=
+			__atomic_load_n(&asid_generation, __ATOMIC_ACQUIRE) ||
+		asid_flush_pending[cpu]) {
+		acquire(&asid_lock);
+		if ((p->asid & ~(nr_asids - 1)) != asid_generation)
+			asid_new(p);
+		if (asid_flush_pending[cpu]) {
+			asid_flush_pending[cpu] = 0;
+			sfence_vma();
+		}
+		release(&asid_lock);
+	}
+
+	p->tlb_cpus |= 1UL << cpu;
+	return MAKE_SATP_ASID(p->pagetable, asid_of(p));
+}
+
+// Start gathering pages of p whose PTEs are about to change.
+void tlb_batch_init(struct tlb_batch *b, struct proc *p) {
+	b->p	 = p;
+	b->start = -1UL;
+	b->end	 = 0;
+}
+
+// Add the pages of [start, end) to the batch. The batch covers
+// the smallest range holding all pages added.
+void tlb_batch_add(struct tlb_batch *b, uint64_t start, uint64_t end) {
+	b->start = min(b->start, PGROUNDDOWN(start));
+	b->end	 = max(b->end, PGROUNDUP(end));
+}
+
+// Flush the TLB entries of the pages in the batch, here and on the
+// other harts which ran the process with its ASID. Without the SBI
+// remote fence, the process gets a new ASID on its way back to user
+// space instead, so the stale entries are never used again.
+void tlb_batch_flush(struct tlb_batch *b) {
+	struct proc *p = b->p;
+	uint64_t	 npages, asid, others, va;
+
+	// no process, the page table isn't in use.
+	if (p == 0 || b->start >= b->end)
+		return;
+	npages = (b->end - b->start) / PGSIZE;
+
+	push_off();
+	if (!use_asids) {
+		// nothing is left in other harts' TLBs when they switch.
+		sfence_vma();
+		goto out;
+	}
+
+	asid = asid_of(p);
+	if (npages > TLB_FLUSH_MAX_PAGES) {
+		sfence_vma_asid(asid);
+	}
+	else {
+		for (va = b->start; va < b->end; va += PGSIZE)
+			sfence_vma_page(va, asid);
+	}
+
+	others = p->tlb_cpus & ~(1UL << cpu_id());
+	if (others == 0)
+		goto out;
+	if (has_rfence &&
+		sbi_ecall_remote_sfence_vma_asid(
+			others, b->start,
+			npages > TLB_FLUSH_MAX_PAGES ? -1UL : b->end - b->start,
+			asid) == SBI_SUCCESS) {
+		// p runs here, so the others hold nothing of it any more.
+		p->tlb_cpus &= ~others;
+	}
+	else {
+		p->asid = 0;
+	}
+
+out:
+	pop_off();
+	b->start = -1UL;
+	b->end	 = 0;
+}
+
+// Flush the TLB entries of [start, end) of p everywhere, p may be 0
+// for a page table not in use.
+void flush_tlb_range(struct proc *p, uint64_t start, uint64_t end) {
+	struct tlb_batch b;
+
+	tlb_batch_init(&b, p);
+	tlb_batch_add(&b, start, end);
+	tlb_batch_flush(&b);
+}
+
+// Flush the TLB entry of the page at va of p on this hart, after it
+// was mapped by a page fault here. Other harts never had a valid
+// entry of it.
+void flush_tlb_page(struct proc *p, uint64_t va) {
+	sfence_vma_page(va, asid_of(p));
+}
+
+// Forget the ASID of p, whose page table goes away. The TLB entries
+// tagged with it are never used again in this generation.
+void asid_release(struct proc *p) {
+	p->asid		= 0;
+	p->tlb_cpus = 0;
+}
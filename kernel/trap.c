@@ -62,6 +62,23 @@ void usertrap(void) {
 	else if ((which_dev = devintr()) != 0) {
 		// ok
 	}
+	else if (r_scause() == 12 || r_scause() == 13 || r_scause() == 15) {
+		// page fault on a program or heap page not touched yet,
+		// or a store to a copy-on-write page.
+		uint64_t scause = r_scause(), stval = r_stval();
+		int		 type	= scause == 12	 ? FAULT_EXEC
+						  : scause == 15 ? FAULT_WRITE
+										 : FAULT_READ;
+
+		// reading the page from the program file may sleep.
+		intr_on();
+
+		if (uvmfault(p, stval, type) < 0) {
+			printk("usertrap(): page fault scause %p pid=%d\n", scause, p->pid);
+			printk("            sepc=%p stval=%p\n", p->trapframe->epc, stval);
+			setkilled(p);
+		}
+	}
 	else {
 		printk("usertrap(): unexpected scause %p pid=%d\n", r_scause(), p->pid);
 		printk("            sepc=%p stval=%p\n", r_sepc(), r_stval());
@@ -106,6 +123,7 @@ void usertrapret(void) {
 	// set S Previous Privilege mode to User.
 	unsigned long x = r_sstatus();
 	x &= ~SSTATUS_SPP; // clear SPP to 0 for user mode
+	x &= ~SSTATUS_VS;  // user procs have no vector state
 	x |= SSTATUS_SPIE; // enable interrupts in user mode
 	w_sstatus(x);
 
@@ -113,7 +131,7 @@ void usertrapret(void) {
 	w_sepc(p->trapframe->epc);
 
 	// tell trampoline.S the user page table to switch to.
-	uint64_t satp = MAKE_SATP(p->pagetable);
+	uint64_t satp = proc_satp(p);
 
 	// jump to userret in trampoline.S at the top of memory, which
 	// switches to the user page table, restores user registers,
@@ -154,7 +172,7 @@ void kerneltrap() {
 // check if it's an external interrupt or software interrupt,
 // and handle it.
 // returns 3 if software interrupt
-// 2 if timer interrupt,
+// 2 if the time slice is over,
 // 1 if other device,
 // 0 if not recognized.
 int devintr() {
@@ -163,10 +181,11 @@ int devintr() {
 	if (scause & SCAUSE_INTERRUPT) {
 		switch (scause) {
 			case SCAUSE_SSI:
-				// software interrupt
+				// software interrupt, an ipi to wake up an idle cpu
+				w_sip(r_sip() & ~SIP_SSIP);
 				return 3;
 
-			case SCAUSE_STI: timer_tick(); return 2;
+			case SCAUSE_STI: return timer_tick() ? 2 : 1;
 
 			case SCAUSE_SEI:
 				// this is a supervisor external interrupt, via PLIC.
@@ -116,14 +116,11 @@ void virtio_disk_init(void) {
 		panic("virtio disk max queue too short");
 
 	// allocate and zero queue memory.
-	disk.desc  = kalloc();
-	disk.avail = kalloc();
-	disk.used  = kalloc();
+	disk.desc  = kzalloc();
+	disk.avail = kzalloc();
+	disk.used  = kzalloc();
 	if (!disk.desc || !disk.avail || !disk.used)
 		panic("virtio disk kalloc");
-	memset(disk.desc, 0, PGSIZE);
-	memset(disk.avail, 0, PGSIZE);
-	memset(disk.used, 0, PGSIZE);
 
 	// set queue size.
 	*R(VIRTIO_MMIO_QUEUE_NUM) = NUM;
@@ -5,6 +5,7 @@
 #include "memlayout.h"
 #include "mm.h"
 #include "param.h"
+#include "proc.h"
 #include "riscv.h"
 
 /*
@@ -42,21 +43,43 @@ pagetable_t kern_pgtable_init(void) {
 	// the highest virtual address in the kernel.
 	kvmmap(kpgtbl, TRAMPOLINE, (uint64_t)trampoline, PGSIZE, PTE_R | PTE_X);
 
-	// TODO : allocate and map a kernel stack for each process.
-	// proc_mapstacks(kpgtbl);
-
 	return kpgtbl;
 }
 
+// Count the leaf PTEs of each level and the page-table pages
+// of the page table at the given level.
+static void count_ptes(pagetable_t pagetable,
+					   int		   level,
+					   uint64_t	   leaves[],
+					   uint64_t	  *tables) {
+	(*tables)++;
+	for (int i = 0; i < 512; i++) {
+		pte_t pte = pagetable[i];
+
+		if ((pte & PTE_V) == 0)
+			continue;
+		if (PTE_LEAF(pte))
+			leaves[level]++;
+		else if (level > 0)
+			count_ptes((pagetable_t)PTE2PA(pte), level - 1, leaves, tables);
+	}
+}
+
 // Initialize the one kernel_pagetable
 void kern_vm_init(void) {
+	uint64_t leaves[MAX_LEAF_LEVEL + 1] = {0}, tables = 0;
+
 	max_pa			 = ram_end();
 	kernel_pagetable = kern_pgtable_init();
+
+	count_ptes(kernel_pagetable, PT_TOP_LEVEL, leaves, &tables);
+	pr_info("kernel page table: %lu 4K, %lu 2M, %lu 1G PTEs in %lu pages",
+			leaves[0], leaves[1], leaves[2], tables);
 }
 
 // Switch h/w page table register to the kernel's page table,
 // and enable paging.
-void kern_vm_init_hart() {
+void kvm_init_hart() {
 	// wait for any previous writes to the page table memory to finish.
 	sfence_vma();
 
@@ -69,6 +92,9 @@ void kern_vm_init_hart() {
 // Return the address of the PTE in page table pagetable
 // that corresponds to virtual address va.  If alloc != 0,
 // create any required page-table pages.
+// The PTE is looked up at leaf_level, whose leaves map
+// PXSIZE(leaf_level) bytes. A leaf met at a higher level, that is a
+// megapage or gigapage covering va, is returned instead.
 //
 // !!! Only support Sv39/Sv48/Sv57 now !!!
 //
@@ -82,49 +108,49 @@ void kern_vm_init_hart() {
 //         21..29 -- 9 bits of level-1 index.
 //         12..20 -- 9 bits of level-0 index.
 //          0..11 -- 12 bits of byte offset within the page.
-pte_t *walk(pagetable_t pagetable, uint64_t va, int alloc) {
+static pte_t *
+walk_level(pagetable_t pagetable, uint64_t va, int alloc, int leaf_level) {
 	if (va >= MAX_VA)
 		panic("walk");
 
-#ifdef __RISCV_SV32__
-	int level = 1;
-#endif
-#ifdef __RISCV_SV39__
-	int level = 2;
-#endif
-#ifdef __RISCV_SV48__
-	int level = 3;
-#endif
-#ifdef __RISCV_SV57__
-	int level = 4;
-#endif
-
-	for (; level > 0; level--) {
+	for (int level = PT_TOP_LEVEL; level > leaf_level; level--) {
 		pte_t *pte = &pagetable[PX(level, va)];
 		if (*pte & PTE_V) {
+			if (PTE_LEAF(*pte))
+				return pte;
 			pagetable = (pagetable_t)PTE2PA(*pte);
 		}
 		else {
-			if (!alloc || (pagetable = (pde_t *)alloc_pages(1)) == 0)
+			if (!alloc || (pagetable = (pde_t *)alloc_zero_pages(1)) == 0)
 				return 0;
-			memset(pagetable, 0, PGSIZE);
 			*pte = PA2PTE(pagetable) | PTE_V;
 		}
 	}
-	return &pagetable[PX(0, va)];
+	return &pagetable[PX(leaf_level, va)];
+}
+
+pte_t *walk(pagetable_t pagetable, uint64_t va, int alloc) {
+	return walk_level(pagetable, va, alloc, 0);
 }
 
 // Look up a virtual address, return the physical address,
-// or 0 if not mapped.
+// or 0 if not mapped. Heap pages of the current process that
+// were not touched yet are faulted in.
 // Can only be used to look up user pages.
 uint64_t walkaddr(pagetable_t pagetable, uint64_t va) {
-	pte_t	  *pte;
-	uint64_t pa;
+	struct proc *p = this_proc();
+	pte_t		  *pte;
+	uint64_t	 pa;
 
 	if (va >= MAX_VA)
 		return 0;
 
 	pte = walk(pagetable, va, 0);
+	if ((pte == 0 || (*pte & PTE_V) == 0) && p && pagetable == p->pagetable) {
+		if (uvmfault(p, va, FAULT_READ) < 0)
+			return 0;
+		pte = walk(pagetable, va, 0);
+	}
 	if (pte == 0)
 		return 0;
 	if ((*pte & PTE_V) == 0)
@@ -146,12 +172,15 @@ void kvmmap(
 
 // Create PTEs for virtual addresses starting at va that refer to
 // physical addresses starting at pa. va and size might not
-// be page-aligned. Returns 0 on success, -1 if walk() couldn't
+// be page-aligned. Wherever va, pa and the remaining size allow,
+// a megapage or gigapage leaf is used instead of 4K pages.
+// Returns 0 on success, -1 if walk() couldn't
 // allocate a needed page-table page.
 int mappages(
 	pagetable_t pagetable, uint64_t va, uint64_t size, uint64_t pa, int perm) {
-	uint64_t cur, last;
+	uint64_t cur, last, sz;
 	pte_t	  *pte;
+	int		 level;
 
 	if (size == 0)
 		panic("mappages: size");
@@ -159,21 +188,37 @@ int mappages(
 	cur	 = PGROUNDDOWN(va);
 	last = PGROUNDDOWN(va + size - 1);
 	for (;;) {
-		if ((pte = walk(pagetable, cur, 1)) == 0)
-			return -1;
+		for (level = MAX_LEAF_LEVEL; level >= 0; level--) {
+			sz = PXSIZE(level);
+			// a leaf of this level must be aligned and fit in the range.
+			if (level > 0 &&
+				(((cur | pa) & (sz - 1)) != 0 || last - cur < sz - PGSIZE))
+				continue;
+			if ((pte = walk_level(pagetable, cur, 1, level)) == 0)
+				return -1;
+			// a page table is already in place, use smaller leaves.
+			if (level > 0 && (*pte & PTE_V) && !PTE_LEAF(*pte))
+				continue;
+			break;
+		}
 		if (*pte & PTE_V)
 			panic("mappages: remap");
-		*pte = PA2PTE(pa) | perm | PTE_V;
-		if (cur == last)
+		// harts may fault on a clear A/D bit instead of setting it.
+		// User pages get D on their first store, see uvmfault(),
+		// so the writeback of shared mappings can tell them apart.
+		*pte = PA2PTE(pa) | perm | PTE_V | PTE_A;
+		if ((perm & (PTE_W | PTE_U)) == PTE_W)
+			*pte |= PTE_D;
+		if (last - cur < sz)
 			break;
-		cur += PGSIZE;
-		pa += PGSIZE;
+		cur += sz;
+		pa += sz;
 	}
 	return 0;
 }
 
 // Remove npages of mappings starting from va. va must be
-// page-aligned. The mappings must exist.
+// page-aligned. Pages never touched since sbrk() are skipped.
 // Optionally free the physical memory.
 void uvmunmap(pagetable_t pagetable,
 			  uint64_t	  va,
@@ -186,10 +231,8 @@ void uvmunmap(pagetable_t pagetable,
 		panic("uvmunmap: not aligned");
 
 	for (a = va; a < va + npages * PGSIZE; a += PGSIZE) {
-		if ((pte = walk(pagetable, a, 0)) == 0)
-			panic("uvmunmap: walk");
-		if ((*pte & PTE_V) == 0)
-			panic("uvmunmap: not mapped");
+		if ((pte = walk(pagetable, a, 0)) == 0 || (*pte & PTE_V) == 0)
+			continue;
 		if (PTE_FLAGS(*pte) == PTE_V)
 			panic("uvmunmap: not a leaf");
 		if (do_free) {
@@ -204,10 +247,9 @@ void uvmunmap(pagetable_t pagetable,
 // returns 0 if out of memory.
 pagetable_t uvmcreate() {
 	pagetable_t pagetable;
-	pagetable = (pagetable_t)kalloc();
+	pagetable = (pagetable_t)kzalloc();
 	if (pagetable == 0)
 		return 0;
-	memset(pagetable, 0, PGSIZE);
 	return pagetable;
 }
 
@@ -219,8 +261,7 @@ void uvmfirst(pagetable_t pagetable, uchar *src, uint sz) {
 
 	if (sz >= PGSIZE)
 		panic("uvmfirst: more than a page");
-	mem = kalloc();
-	memset(mem, 0, PGSIZE);
+	mem = kzalloc();
 	mappages(pagetable, 0, PGSIZE, (uint64_t)mem,
 			 PTE_W | PTE_R | PTE_X | PTE_U);
 	memmove(mem, src, sz);
@@ -238,12 +279,11 @@ uvmalloc(pagetable_t pagetable, uint64_t oldsz, uint64_t newsz, int xperm) {
 
 	oldsz = PGROUNDUP(oldsz);
 	for (a = oldsz; a < newsz; a += PGSIZE) {
-		mem = kalloc();
+		mem = kzalloc();
 		if (mem == 0) {
 			uvmdealloc(pagetable, a, oldsz);
 			return 0;
 		}
-		memset(mem, 0, PGSIZE);
 		if (mappages(pagetable, a, PGSIZE, (uint64_t)mem,
 					 PTE_R | PTE_U | xperm) != 0) {
 			kfree(mem);
@@ -254,6 +294,15 @@ uvmalloc(pagetable_t pagetable, uint64_t oldsz, uint64_t newsz, int xperm) {
 	return newsz;
 }
 
+// The process whose TLB entries a change of user page table
+// pagetable must be flushed from, or 0. Only the current process's
+// table can be in use, other ones are new or going away.
+static struct proc *uvmowner(pagetable_t pagetable) {
+	struct proc *p = this_proc();
+
+	return p && p->pagetable == pagetable ? p : 0;
+}
+
 // Deallocate user pages to bring the process size from oldsz to
 // newsz.  oldsz and newsz need not be page-aligned, nor does newsz
 // need to be less than oldsz.  oldsz can be larger than the actual
@@ -265,6 +314,8 @@ uint64_t uvmdealloc(pagetable_t pagetable, uint64_t oldsz, uint64_t newsz) {
 	if (PGROUNDUP(newsz) < PGROUNDUP(oldsz)) {
 		int npages = (PGROUNDUP(oldsz) - PGROUNDUP(newsz)) / PGSIZE;
 		uvmunmap(pagetable, PGROUNDUP(newsz), npages, 1);
+		flush_tlb_range(uvmowner(pagetable), PGROUNDUP(newsz),
+						PGROUNDUP(oldsz));
 	}
 
 	return newsz;
@@ -297,38 +348,77 @@ void uvmfree(pagetable_t pagetable, uint64_t sz) {
 	freewalk(pagetable);
 }
 
-// Given a parent process's page table, copy
-// its memory into a child's page table.
-// Copies both the page table and the
-// physical memory.
+// Given a parent process's page table, share
+// its memory in [start, end) with a child's page table.
+// Only the page table is copied. Unless shared is set,
+// writable pages are mapped read-only and copy-on-write
+// in both, and copied on the first store by uvmcow().
 // returns 0 on success, -1 on failure.
 // frees any allocated pages on failure.
+int uvmcopy_range(
+	pagetable_t old, pagetable_t new, uint64_t start, uint64_t end, int shared) {
+	struct tlb_batch batch;
+	pte_t			*pte;
+	uint64_t		 pa, i;
+	uint			 flags;
+
+	tlb_batch_init(&batch, uvmowner(old));
+	for (i = start; i < end; i += PGSIZE) {
+		// not touched yet, the child faults it in by itself.
+		if ((pte = walk(old, i, 0)) == 0 || (*pte & PTE_V) == 0)
+			continue;
+		if (!shared && (*pte & PTE_W)) {
+			*pte = (*pte & ~PTE_W) | PTE_COW;
+			tlb_batch_add(&batch, i, i + PGSIZE);
+		}
+		pa	  = PTE2PA(*pte);
+		flags = PTE_FLAGS(*pte) & ~PTE_D; // the child has written nothing
+		if (mappages(new, i, PGSIZE, pa, flags) != 0)
+			goto err;
+		kdup((void *)pa);
+	}
+	// the parent lost write access to its pages.
+	tlb_batch_flush(&batch);
+	return 0;
+
+err:
+	tlb_batch_flush(&batch);
+	uvmunmap(new, start, (i - start) / PGSIZE, 1);
+	return -1;
+}
+
 int uvmcopy(pagetable_t old, pagetable_t new, uint64_t sz) {
+	return uvmcopy_range(old, new, 0, sz, 0);
+}
+
+// Give the process a private, writable copy of the copy-on-write
+// page at va, on a store page fault or before the kernel writes it.
+// Returns 0 on success, -1 if va is not a COW page or out of memory.
+int uvmcow(pagetable_t pagetable, uint64_t va) {
 	pte_t	  *pte;
-	uint64_t pa, i;
-	uint	 flags;
+	uint64_t pa;
 	char	 *mem;
 
-	for (i = 0; i < sz; i += PGSIZE) {
-		if ((pte = walk(old, i, 0)) == 0)
-			panic("uvmcopy: pte should exist");
-		if ((*pte & PTE_V) == 0)
-			panic("uvmcopy: page not present");
-		pa	  = PTE2PA(*pte);
-		flags = PTE_FLAGS(*pte);
+	if (va >= MAX_VA)
+		return -1;
+	pte = walk(pagetable, PGROUNDDOWN(va), 0);
+	if (pte == 0 || (*pte & PTE_V) == 0 || (*pte & PTE_U) == 0 ||
+		(*pte & PTE_COW) == 0)
+		return -1;
+
+	pa = PTE2PA(*pte);
+	if (kshared((void *)pa)) {
 		if ((mem = kalloc()) == 0)
-			goto err;
+			return -1;
 		memmove(mem, (char *)pa, PGSIZE);
-		if (mappages(new, i, PGSIZE, (uint64_t)mem, flags) != 0) {
-			kfree(mem);
-			goto err;
-		}
+		*pte = PA2PTE(mem) | PTE_FLAGS(*pte);
+		kfree((void *)pa); // drop our hold of the shared page
 	}
+	// the last holder just takes the page back.
+	*pte = (*pte & ~PTE_COW) | PTE_W | PTE_D; // for a store
+	flush_tlb_range(uvmowner(pagetable), PGROUNDDOWN(va),
+					PGROUNDDOWN(va) + PGSIZE);
 	return 0;
-
-err:
-	uvmunmap(new, 0, i / PGSIZE, 1);
-	return -1;
 }
 
 // mark a PTE invalid for user access.
@@ -342,17 +432,125 @@ void uvmclear(pagetable_t pagetable, uint64_t va) {
 	*pte &= ~PTE_U;
 }
 
+// Handle a page fault of process p at va. A page of the program
+// which is not mapped yet is read from its file, a page of an
+// mmap() mapping is handed to vma_fault(), any other page below
+// p->sz gets a zeroed page, and a store to a copy-on-write page
+// gets a private copy. type is FAULT_READ, FAULT_WRITE or FAULT_EXEC.
+// Returns 0 if the fault is handled, -1 if va is a bad address or
+// the access is not allowed.
+int uvmfault(struct proc *p, uint64_t va, int type) {
+	static const int need[] = {
+		[FAULT_READ] = PTE_R, [FAULT_WRITE] = PTE_W, [FAULT_EXEC] = PTE_X};
+	int				 write = type == FAULT_WRITE;
+	struct exec_seg *seg;
+	struct vma		*vma = 0;
+	pte_t			*pte;
+	char			*mem;
+
+	if (va >= p->sz && (vma = vma_find(p, va)) == 0)
+		return -1;
+
+	pte = walk(p->pagetable, va, 0);
+	if (pte && (*pte & PTE_V)) {
+		if ((*pte & PTE_U) && (*pte & need[type])) {
+			// the PTE allows it: either the hart does not set A/D
+			// itself, or the TLB of this hart was stale.
+			*pte |= PTE_A | (write ? PTE_D : 0);
+			flush_tlb_page(p, PGROUNDDOWN(va));
+			return 0;
+		}
+		// otherwise only a store to a COW page is a fault we handle.
+		if (!write || uvmcow(p->pagetable, va) < 0)
+			return -1;
+		p->min_flt++;
+		return 0;
+	}
+
+	if (vma) {
+		if ((type == FAULT_EXEC && !(vma->perm & PTE_X)) ||
+			vma_fault(p, vma, va, write) < 0)
+			return -1;
+	}
+	else if ((seg = exec_seg_of(p, va)) != 0) {
+		if ((write && !(seg->perm & PTE_W)) ||
+			(type == FAULT_EXEC && !(seg->perm & PTE_X)) ||
+			exec_loadpage(p, seg, va) < 0)
+			return -1;
+	}
+	else if (type == FAULT_EXEC) {
+		return -1; // heap pages are not executable
+	}
+	else {
+		if ((mem = kzalloc()) == 0)
+			return -1;
+		if (mappages(p->pagetable, PGROUNDDOWN(va), PGSIZE, (uint64_t)mem,
+					 PTE_R | PTE_W | PTE_U) != 0) {
+			kfree(mem);
+			return -1;
+		}
+	}
+	// the store that faulted dirties the page.
+	if (write && (pte = walk(p->pagetable, va, 0)) != 0)
+		*pte |= PTE_D;
+	flush_tlb_page(p, PGROUNDDOWN(va));
+
+	p->min_flt++;
+	return 0;
+}
+
+// Whether a fault at va of p reads a file, which sleeps on its inode.
+static int uvm_file_backed(struct proc *p, uint64_t va) {
+	struct vma *v;
+
+	if (va < p->sz)
+		return exec_seg_of(p, va) != 0;
+	return (v = vma_find(p, va)) != 0 && v->file != 0;
+}
+
+// Fault in the pages of [va, va + len) of p which are not mapped
+// yet and are read from a file. For callers that copy from or to
+// them holding a spinlock, where the fault can not sleep, or an
+// inode lock, which the fault may need itself. Anonymous pages are
+// left to fault in on demand, that never sleeps, and bad addresses
+// for the copy itself to fail on.
+void uvmprefault(struct proc *p, uint64_t va, uint64_t len) {
+	pte_t	*pte;
+	uint64_t a;
+
+	for (a = PGROUNDDOWN(va); a < va + len && a < MAX_VA; a += PGSIZE) {
+		pte = walk(p->pagetable, a, 0);
+		if ((pte == 0 || (*pte & PTE_V) == 0) && uvm_file_backed(p, a) &&
+			uvmfault(p, a, FAULT_READ) < 0)
+			break;
+	}
+}
+
 // Copy from kernel to user.
 // Copy len bytes from src to virtual address dstva in a given page table.
 // Return 0 on success, -1 on error.
 int copyout(pagetable_t pagetable, uint64_t dstva, char *src, uint64_t len) {
 	uint64_t n, va0, pa0;
+	pte_t	  *pte;
 
 	while (len > 0) {
 		va0 = PGROUNDDOWN(dstva);
 		pa0 = walkaddr(pagetable, va0);
 		if (pa0 == 0)
 			return -1;
+		// don't write through to pages shared copy-on-write.
+		pte = walk(pagetable, va0, 0);
+		if (*pte & PTE_COW) {
+			if (uvmcow(pagetable, va0) < 0)
+				return -1;
+			pa0 = PTE2PA(*pte);
+		}
+		else if ((*pte & PTE_W) == 0) {
+			return -1; // read-only, maybe text shared with others
+		}
+		// written through the direct map, so the hardware won't
+		// mark it dirty for the writeback of a shared mapping.
+		*pte |= PTE_D;
 		n = PGSIZE - (dstva - va0);
 		if (n > len)
 			n = len;
@@ -1,6 +1,7 @@
 // Physical memory allocator, for early kernel boot stage.
 // Allocates one or more consecutive physical 4096-byte pages at a time.
 
+#include "bitmap.h"
 #include "device_tree.h"
 #include "kernel.h"
 #include "list.h"
@@ -9,6 +10,7 @@
 #include "spinlock.h"
 
 void *(*alloc_pages)(uint32_t npages);
+void *(*alloc_pages_node)(int nid, uint32_t npages);
 void *(*alloc_zero_pages)(uint32_t npages);
 void (*free_pages)(void *addr, uint32_t npages);
 
@@ -25,6 +27,7 @@ static bootmem_node *bootmem_all_nodes[MAX_NUMA_NODE];
 
 static inline void register_mm_handlers(void) {
 	alloc_pages		 = bootmem_alloc;
+	alloc_pages_node = bootmem_alloc_node;
 	alloc_zero_pages = bootmem_alloc_zeros;
 	free_pages		 = bootmem_free;
 }
@@ -38,16 +41,16 @@ int bootmem_init(void) {
 
 	for_each_mem(id, mem) {
 		start_addr = max(mem->base_address, (uint64_t)kernel_end);
-		end_addr   = start_addr + mem->ram_size;
+		end_addr   = mem->base_address + mem->ram_size;
 
 		// alloc the last page of mem in this numa node for `bootmem_node`,
 		// which will be reclaimed after destoying the bootmem.
-		node				  = (bootmem_node *)(end_addr - PGSIZE);
-		bootmem_all_nodes[id] = node;
+		node = (bootmem_node *)(end_addr - PGSIZE);
+		bootmem_all_nodes[mem->numa_node_id] = node;
 
 		INIT_LIST_HEAD(&node->list);
 		initlock(&node->lock, "bootmem");
-		node->npages	= mem->ram_size >> PGSHIFT;
+		node->npages	= (end_addr - start_addr) >> PGSHIFT;
 		node->start_pfn = pa_to_pfn(start_addr);
 
 		bitmap_size	  = (node->npages + 63) / 64 * sizeof(*(node->bitmap));
@@ -62,13 +65,8 @@ int bootmem_init(void) {
 		node->next_offset = 0;
 
 		// mark pages of bootmem_node with related bitmap as used.
-		// use `for loop` to make this simple.
-		uint32_t off  = pa_to_pfn((uint64_t)node->bitmap) - node->start_pfn;
-		uint32_t rest = 64 - (off & 63);
-		node->bitmap[off >> 6] |= ((1 << rest) - 1);
-		off += rest;
-		if (off < node->npages)
-			memset(&node->bitmap[off >> 6], 1, (node->npages - off) / 8);
+		uint32_t off = pa_to_pfn((uint64_t)node->bitmap) - node->start_pfn;
+		bitmap_set_range(node->bitmap, off, node->npages - off);
 	}
 
 	register_mm_handlers();
@@ -77,61 +75,61 @@ int bootmem_init(void) {
 }
 
 void *bootmem_alloc(uint32_t npages) {
-	cpu_info	 *cpu	   = cpu_of(cpu_id());
-	bootmem_node *node	   = bootmem_all_nodes[cpu->numa_node_id];
+	cpu_info *cpu = cpu_of(cpu_id());
+
+	return bootmem_alloc_node(cpu->numa_node_id, npages);
+}
+
+// Allocate npages consecutive pages from the given numa node only.
+// The search starts where the last one ended and wraps around once.
+static void *__bootmem_alloc_node(int nid, uint32_t npages) {
+	bootmem_node *node	   = bootmem_all_nodes[nid];
 	uint64_t	  phy_addr = 0;
-	int			  retry	   = 1;
+	uint64_t	  off;
+
+	if (node == 0 || npages == 0 || npages >= node->npages)
+		return 0;
 
 	acquire(&node->lock);
 
-	if (npages >= node->npages)
-		goto out;
-
-	int start, end;
-repeat:
-	if (node->next_offset + npages < node->npages) {
-		start = node->next_offset;
-		end	  = start + npages;
-		while (start < end) {
-			int row = start;
-			int col = do_div(row, 64);
-			if (node->bitmap[row] & (1 << (63 - col))) {
-				// current page already allocated
-				node->next_offset = start + 1;
-				goto repeat;
-			}
-			start++;
-		}
+	off = bitmap_find_zero_area(node->bitmap, node->npages, node->next_offset,
+								npages);
+	if (off == node->npages && node->next_offset != 0)
+		off = bitmap_find_zero_area(node->bitmap, node->npages, 0, npages);
 
-		// now we found the usable continuous pages,
-		// calculate the start address to return and fill the bitmap
-		phy_addr = (node->start_pfn + node->next_offset) << PGSHIFT;
-		while (node->next_offset < end) {
-			int row = node->next_offset;
-			int col = do_div(row, 64);
-			node->bitmap[row] |= (1UL << (63 - col));
-			node->next_offset++;
-		}
-	}
-	else if (retry) {
-		node->next_offset = 0;
-		retry			  = 0;
-		goto repeat;
-	}
-	else {
-		pr_warn("no enough space of numa node %d to allocate %d pages.",
-				cpu->numa_node_id, npages);
+	if (off != node->npages) {
+		bitmap_set_range(node->bitmap, off, npages);
+		node->next_offset = off + npages;
+		phy_addr		  = pfn_to_pa(node->start_pfn + off);
 	}
 
-out:
 	release(&node->lock);
 
 	return (void *)phy_addr;
 }
 
+// Allocate npages consecutive pages from the given numa node, or from
+// the nearest node which has enough space.
+void *bootmem_alloc_node(int nid, uint32_t npages) {
+	void *phy_addr;
+	int	  i, fb;
+
+	for_each_fallback_node(nid, i, fb) {
+		if ((phy_addr = __bootmem_alloc_node(fb, npages)) != 0) {
+			numa_stat_account(nid, fb, npages);
+			return phy_addr;
+		}
+	}
+
+	pr_warn("no enough space of any numa node to allocate %d pages.", npages);
+	return 0;
+}
+
 void *bootmem_alloc_zeros(uint32_t npages) {
 	void *phy_addr = bootmem_alloc(npages);
-	memset(phy_addr, 0, npages << PGSHIFT);
+
+	if (phy_addr)
+		memset(phy_addr, 0, npages << PGSHIFT);
 	return phy_addr;
 }
 
@@ -139,17 +137,50 @@ void bootmem_free(void *addr, uint32_t npages) {
 	if ((uint64_t)addr & (PGSIZE - 1))
 		panic("addr of bootmem_free should be aligned to PGSIZE(4k).");
 
-	cpu_info	 *cpu  = cpu_of(cpu_id());
-	bootmem_node *node = bootmem_all_nodes[cpu->numa_node_id];
+	bootmem_node *node = 0;
 	uint64_t	  pfn  = ((uint64_t)addr) >> PGSHIFT;
 
-	acquire(&node->lock);
-
-	for (int i = 0; i < npages; i++) {
-		int row = (pfn++) - node->start_pfn;
-		int col = do_div(row, 64);
-		node->bitmap[row] &= ~(1 << (63 - col));
+	// the pages may come from a fallback node, find their owner.
+	for (int nid = 0; nid < MAX_NUMA_NODE; nid++) {
+		node = bootmem_all_nodes[nid];
+		if (node && pfn >= node->start_pfn &&
+			pfn + npages <= node->start_pfn + node->npages)
+			break;
+		node = 0;
 	}
+	if (node == 0)
+		panic("bootmem_free: invalid address");
 
+	acquire(&node->lock);
+	bitmap_clear_range(node->bitmap, pfn - node->start_pfn, npages);
 	release(&node->lock);
 }
+
+// Destroy the bootmem: report every run of free pages, then the pages
+// holding the bitmap and `bootmem_node` themselves, to free_range().
+// Used to hand the remaining memory over to the buddy system, bootmem
+// must not be used any more after this.
+void bootmem_free_all(void (*free_range)(uint64_t pfn, uint64_t npages)) {
+	bootmem_node *node;
+	uint64_t	  start_pfn, meta_pfn, meta_npages;
+	uint64_t	  off, end;
+
+	for (int nid = 0; nid < MAX_NUMA_NODE; nid++) {
+		if ((node = bootmem_all_nodes[nid]) == 0)
+			continue;
+
+		start_pfn	= node->start_pfn;
+		meta_pfn	= pa_to_pfn((uint64_t)node->bitmap);
+		meta_npages = start_pfn + node->npages - meta_pfn;
+
+		off = bitmap_find_next_zero(node->bitmap, meta_pfn - start_pfn, 0);
+		while (off < meta_pfn - start_pfn) {
+			end = bitmap_find_next_set(node->bitmap, meta_pfn - start_pfn, off);
+			free_range(start_pfn + off, end - off);
+			off = bitmap_find_next_zero(node->bitmap, meta_pfn - start_pfn, end);
+		}
+
+		bootmem_all_nodes[nid] = 0;
+		free_range(meta_pfn, meta_npages);
+	}
+}
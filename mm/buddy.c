@@ -0,0 +1,595 @@
+// Buddy system physical page allocator.
+// Takes over from bootmem once the kernel page table is set up.
+// Every numa node keeps free lists of 2^order consecutive pages,
+// allocation splits the smallest block which fits and freeing merges
+// a block with its buddy for as long as the buddy is free as well,
+// so both are O(MAX_ORDER).
+// Single pages go through a per-cpu cache first, which is refilled
+// from and drained to the node in batches, so the common case takes
+// no lock at all.
+// When a node runs out of free pages, allocations fall back to the
+// other nodes, nearest first.
+// Idle cpus zero pages in advance into a pool per node, which serves
+// single zeroed page allocations without zeroing on the spot.
+
+#include "device_tree.h"
+#include "kernel.h"
+#include "list.h"
+#include "math.h"
+#include "mm.h"
+#include "spinlock.h"
+
+struct free_area {
+	struct list_head free_list;
+	uint64_t		 nr_free; // number of free blocks of this order
+};
+
+typedef struct {
+	struct spinlock	 lock;
+	uint64_t		 start_pfn;
+	uint64_t		 npages;
+	uint64_t		 nr_free; // number of free pages of the node
+	struct page		*mem_map; // struct page of each page frame
+	struct free_area free_area[MAX_ORDER + 1];
+} buddy_node;
+
+static buddy_node buddy_all_nodes[MAX_NUMA_NODE];
+
+#define PCP_HIGH 64	 // drain the per-cpu list when it grows beyond this
+#define PCP_BATCH 16 // pages moved per refill/drain
+
+// Per-cpu cache of single free pages, only touched by its own cpu
+// with interrupts off.
+struct per_cpu_pages {
+	struct list_head list;
+	uint32_t		 count;
+	uint64_t		 allocs;  // single page allocations
+	uint64_t		 hits;	  // served from the list without a refill
+	uint64_t		 refills; // batches taken from the node
+	uint64_t		 drains;  // batches given back to the node
+};
+
+static struct per_cpu_pages pcp_all_cpus[MAX_CPU];
+
+#define ZERO_POOL_HIGH 256 // at most so many pages, or 1/64 of the node
+#define ZERO_POOL_BATCH 8  // pages zeroed per zero_pool_refill() call
+
+// Per node pool of zeroed single pages, filled by idle cpus.
+struct zero_pool {
+	struct spinlock	 lock;
+	struct list_head list;
+	uint32_t		 count;
+	uint32_t		 low;		 // start refilling below this
+	uint32_t		 high;		 // stop refilling at this
+	int				 refilling;	 // count went below low, not yet high
+	uint64_t		 hits;		 // zeroed allocations served by the pool
+	uint64_t		 misses;	 // zeroed allocations zeroed on the spot
+	uint64_t		 zeroed;	 // pages zeroed in the background
+};
+
+static struct zero_pool zero_pools[MAX_NUMA_NODE];
+
+static void *zero_pool_get(int nid);
+
+#define for_each_buddy_node(nid, node)                              \
+	for (nid = 0; node = &buddy_all_nodes[nid], nid < MAX_NUMA_NODE; \
+		 nid++)                                                      \
+		if (node->mem_map)
+
+static inline void register_mm_handlers(void) {
+	alloc_pages		 = buddy_alloc;
+	alloc_pages_node = buddy_alloc_node;
+	alloc_zero_pages = buddy_alloc_zeros;
+	free_pages		 = buddy_free;
+}
+
+static buddy_node *pfn_to_node(uint64_t pfn) {
+	buddy_node *node;
+	int			nid;
+
+	for_each_buddy_node(nid, node) {
+		if (pfn >= node->start_pfn && pfn < node->start_pfn + node->npages)
+			return node;
+	}
+	return 0;
+}
+
+// The numa node page frame pfn belongs to, or -1.
+int pfn_to_nid(uint64_t pfn) {
+	buddy_node *node = pfn_to_node(pfn);
+
+	return node ? node - buddy_all_nodes : -1;
+}
+
+struct page *pfn_to_page(uint64_t pfn) {
+	buddy_node *node = pfn_to_node(pfn);
+
+	if (node == 0)
+		return 0;
+	return &node->mem_map[pfn - node->start_pfn];
+}
+
+uint64_t page_to_pfn(struct page *page) {
+	buddy_node *node;
+	int			nid;
+
+	for_each_buddy_node(nid, node) {
+		if (page >= node->mem_map && page < node->mem_map + node->npages)
+			return node->start_pfn + (page - node->mem_map);
+	}
+	panic("page_to_pfn");
+}
+
+// smallest order whose block holds npages pages.
+static inline uint32_t npages_to_order(uint32_t npages) {
+	uint32_t order = 0;
+
+	while ((1UL << order) < npages)
+		order++;
+	return order;
+}
+
+// Put the block of 2^order pages starting at page index idx back into
+// the free lists, merging it with its buddy as far as possible.
+// Caller must hold node->lock.
+static void __free_block(buddy_node *node, uint64_t idx, uint32_t order) {
+	struct page *page, *buddy;
+	uint64_t	 buddy_idx;
+
+	while (order < MAX_ORDER) {
+		buddy_idx = idx ^ (1UL << order);
+		if (buddy_idx + (1UL << order) > node->npages)
+			break;
+
+		buddy = &node->mem_map[buddy_idx];
+		if (!(buddy->flags & PG_buddy) || buddy->order != order)
+			break;
+
+		// buddy is free too, take it out and merge.
+		list_del(&buddy->list);
+		buddy->flags &= ~PG_buddy;
+		node->free_area[order].nr_free--;
+
+		idx &= buddy_idx;
+		order++;
+	}
+
+	page		= &node->mem_map[idx];
+	page->flags = PG_buddy;
+	page->order = order;
+	list_add(&page->list, &node->free_area[order].free_list);
+	node->free_area[order].nr_free++;
+}
+
+// Free page index range [start, end) as naturally aligned blocks.
+// Caller must hold node->lock.
+static void __free_range(buddy_node *node, uint64_t start, uint64_t end) {
+	uint32_t order;
+
+	while (start < end) {
+		order = start ? min(__builtin_ctzl(start), MAX_ORDER) : MAX_ORDER;
+		while (start + (1UL << order) > end)
+			order--;
+
+		__free_block(node, start, order);
+		start += 1UL << order;
+	}
+}
+
+// Take a block of 2^order pages out of the free lists, splitting a
+// larger block if needed. Returns the page index of the block, or -1.
+// Caller must hold node->lock.
+static int64_t __alloc_block(buddy_node *node, uint32_t order) {
+	struct free_area *area;
+	struct page		*page, *buddy;
+	uint64_t		  idx;
+	uint32_t		  cur;
+
+	for (cur = order; cur <= MAX_ORDER; cur++) {
+		area = &node->free_area[cur];
+		if (list_empty(&area->free_list))
+			continue;
+
+		page = list_first_entry(&area->free_list, struct page, list);
+		list_del(&page->list);
+		page->flags &= ~PG_buddy;
+		area->nr_free--;
+		idx = page - node->mem_map;
+
+		// give the upper halves back until the block fits.
+		while (cur > order) {
+			cur--;
+			buddy		 = &node->mem_map[idx + (1UL << cur)];
+			buddy->flags = PG_buddy;
+			buddy->order = cur;
+			list_add(&buddy->list, &node->free_area[cur].free_list);
+			node->free_area[cur].nr_free++;
+		}
+
+		return idx;
+	}
+
+	return -1;
+}
+
+// Move up to PCP_BATCH single pages into the per-cpu list, from the
+// nearest node of nid which has free pages. Returns the number of
+// pages moved.
+static uint32_t pcp_refill(struct per_cpu_pages *pcp, int nid) {
+	struct page *page;
+	buddy_node	*node;
+	int64_t		 idx;
+	uint32_t	 n = 0;
+	int			 i, fb;
+
+	for_each_fallback_node(nid, i, fb) {
+		node = &buddy_all_nodes[fb];
+		acquire(&node->lock);
+		for (n = 0; n < PCP_BATCH; n++) {
+			if ((idx = __alloc_block(node, 0)) < 0)
+				break;
+			page		= &node->mem_map[idx];
+			page->flags = PG_pcp;
+			list_add_tail(&page->list, &pcp->list);
+		}
+		node->nr_free -= n;
+		release(&node->lock);
+		if (n)
+			break;
+	}
+
+	pcp->count += n;
+	pcp->refills++;
+	return n;
+}
+
+// Give the PCP_BATCH coldest pages of the per-cpu list back to
+// the nodes they belong to.
+static void pcp_drain(struct per_cpu_pages *pcp) {
+	struct page *page;
+	buddy_node	*node;
+	uint64_t	 pfn;
+
+	for (int i = 0; i < PCP_BATCH && pcp->count > 0; i++) {
+		page = list_last_entry(&pcp->list, struct page, list);
+		list_del(&page->list);
+		page->flags &= ~PG_pcp;
+		pcp->count--;
+
+		pfn	 = page_to_pfn(page);
+		node = pfn_to_node(pfn);
+		acquire(&node->lock);
+		__free_block(node, pfn - node->start_pfn, 0);
+		node->nr_free++;
+		release(&node->lock);
+	}
+	pcp->drains++;
+}
+
+static void *pcp_alloc(int nid) {
+	struct per_cpu_pages *pcp;
+	struct page			 *page = 0;
+
+	push_off();
+	pcp = &pcp_all_cpus[cpu_id()];
+	pcp->allocs++;
+	if (pcp->count > 0)
+		pcp->hits++;
+	if (pcp->count > 0 || pcp_refill(pcp, nid) > 0) {
+		page = list_first_entry(&pcp->list, struct page, list);
+		list_del(&page->list);
+		page->flags &= ~PG_pcp;
+		pcp->count--;
+	}
+	pop_off();
+
+	return page ? page_to_virt(page) : 0;
+}
+
+static void pcp_free(struct page *page) {
+	struct per_cpu_pages *pcp;
+
+	push_off();
+	pcp			= &pcp_all_cpus[cpu_id()];
+	page->flags = PG_pcp;
+	list_add(&page->list, &pcp->list); // hot end, reused first
+	if (++pcp->count > PCP_HIGH)
+		pcp_drain(pcp);
+	pop_off();
+}
+
+// Allocate npages consecutive pages from node only.
+// Returns the page index in node, or -1.
+static int64_t __buddy_alloc_node(buddy_node *node, uint32_t npages) {
+	uint32_t order = npages_to_order(npages);
+	int64_t	 idx;
+
+	acquire(&node->lock);
+	idx = __alloc_block(node, order);
+	if (idx >= 0) {
+		// return the tail of the block which is not asked for.
+		__free_range(node, idx + npages, idx + (1UL << order));
+		node->nr_free -= npages;
+	}
+	release(&node->lock);
+
+	return idx;
+}
+
+// A single page handed out has one holder, kfree() frees it once
+// the last one lets go.
+static inline void *page_ref_init(void *addr) {
+	if (addr)
+		virt_to_page(addr)->refcount = 1;
+	return addr;
+}
+
+// Allocate npages consecutive pages from numa node nid, or from the
+// nearest node which has enough free pages.
+void *buddy_alloc_node(int nid, uint32_t npages) {
+	buddy_node *node;
+	void	   *addr = 0;
+	int64_t		idx;
+	int			i, fb;
+
+	if (npages == 0 || npages_to_order(npages) > MAX_ORDER)
+		return 0;
+
+	// the per-cpu list only caches pages for the local node.
+	if (npages == 1 && nid == cpu_of(cpu_id())->numa_node_id) {
+		if ((addr = pcp_alloc(nid)) != 0) {
+			fb = pfn_to_node(pa_to_pfn((uint64_t)addr)) - buddy_all_nodes;
+			numa_stat_account(nid, fb, 1);
+		}
+	}
+	else {
+		for_each_fallback_node(nid, i, fb) {
+			node = &buddy_all_nodes[fb];
+			if ((idx = __buddy_alloc_node(node, npages)) >= 0) {
+				addr = (void *)pfn_to_pa(node->start_pfn + idx);
+				numa_stat_account(nid, fb, npages);
+				break;
+			}
+		}
+	}
+
+	// the zero pools are the last resort for single pages.
+	if (addr == 0 && npages == 1) {
+		for_each_fallback_node(nid, i, fb) {
+			if ((addr = zero_pool_get(fb)) != 0) {
+				numa_stat_account(nid, fb, 1);
+				break;
+			}
+		}
+	}
+
+	if (addr == 0)
+		pr_warn("no enough space of any numa node to allocate %d pages.",
+				npages);
+	return npages == 1 ? page_ref_init(addr) : addr;
+}
+
+void *buddy_alloc(uint32_t npages) {
+	return buddy_alloc_node(cpu_of(cpu_id())->numa_node_id, npages);
+}
+
+// Take a zeroed page out of the pool of node nid, or 0 if empty.
+static void *zero_pool_get(int nid) {
+	struct zero_pool *pool = &zero_pools[nid];
+	struct page		*page = 0;
+
+	if (pool->count == 0)
+		return 0;
+
+	acquire(&pool->lock);
+	if (!list_empty(&pool->list)) {
+		page = list_first_entry(&pool->list, struct page, list);
+		list_del(&page->list);
+		page->flags &= ~PG_zeroed;
+		if (--pool->count < pool->low)
+			pool->refilling = 1;
+	}
+	release(&pool->lock);
+
+	return page ? page_to_virt(page) : 0;
+}
+
+// Zero up to ZERO_POOL_BATCH pages into the pool of the local node,
+// if it is being refilled. Called by idle cpus with interrupts on,
+// the pages are zeroed without holding any lock.
+// Returns the number of pages zeroed.
+int zero_pool_refill(void) {
+	int				  nid  = cpu_of(cpu_id())->numa_node_id;
+	struct zero_pool *pool = &zero_pools[nid];
+	buddy_node		 *node = &buddy_all_nodes[nid];
+	struct page		 *page;
+	int64_t			  idx;
+	int				  nr = 0;
+
+	if (!pool->refilling || node->mem_map == 0)
+		return 0;
+
+	while (nr < ZERO_POOL_BATCH) {
+		if ((idx = __buddy_alloc_node(node, 1)) < 0)
+			break;
+		page = &node->mem_map[idx];
+		memset(page_to_virt(page), 0, PGSIZE);
+		nr++;
+
+		acquire(&pool->lock);
+		page->flags |= PG_zeroed;
+		list_add_tail(&page->list, &pool->list);
+		pool->zeroed++;
+		if (++pool->count >= pool->high)
+			pool->refilling = 0;
+		release(&pool->lock);
+
+		if (!pool->refilling)
+			break;
+	}
+	return nr;
+}
+
+// Allocate npages zeroed pages, single pages come from the zero pool
+// of the nearest node that has some.
+void *buddy_alloc_zeros(uint32_t npages) {
+	int	  nid = cpu_of(cpu_id())->numa_node_id;
+	void *phy_addr;
+	int	  i, fb;
+
+	if (npages == 1) {
+		for_each_fallback_node(nid, i, fb) {
+			if ((phy_addr = zero_pool_get(fb)) != 0) {
+				__sync_fetch_and_add(&zero_pools[fb].hits, 1);
+				numa_stat_account(nid, fb, 1);
+				return page_ref_init(phy_addr);
+			}
+		}
+		__sync_fetch_and_add(&zero_pools[nid].misses, 1);
+	}
+
+	phy_addr = buddy_alloc(npages);
+	if (phy_addr)
+		memset(phy_addr, 0, npages << PGSHIFT);
+	return phy_addr;
+}
+
+void buddy_free(void *addr, uint32_t npages) {
+	uint64_t	pfn = pa_to_pfn((uint64_t)addr);
+	buddy_node *node;
+	uint64_t	idx;
+
+	if ((uint64_t)addr & (PGSIZE - 1))
+		panic("addr of buddy_free should be aligned to PGSIZE(4k).");
+
+	node = pfn_to_node(pfn);
+	if (node == 0 || pfn + npages > node->start_pfn + node->npages)
+		panic("buddy_free: invalid address");
+
+	idx = pfn - node->start_pfn;
+	if (node->mem_map[idx].flags &
+		(PG_buddy | PG_pcp | PG_zeroed | PG_reserved))
+		panic("buddy_free: page already free");
+
+	if (npages == 1) {
+		pcp_free(&node->mem_map[idx]);
+		return;
+	}
+
+	acquire(&node->lock);
+	__free_range(node, idx, idx + npages);
+	node->nr_free += npages;
+	release(&node->lock);
+}
+
+// hand pages that bootmem reports free over to the buddy system.
+static void buddy_free_bootmem(uint64_t pfn, uint64_t npages) {
+	buddy_node *node = pfn_to_node(pfn);
+	uint64_t	idx;
+
+	if (node == 0 || pfn + npages > node->start_pfn + node->npages)
+		panic("buddy_free_bootmem");
+
+	idx = pfn - node->start_pfn;
+	for (uint64_t i = idx; i < idx + npages; i++)
+		node->mem_map[i].flags &= ~PG_reserved;
+
+	acquire(&node->lock);
+	__free_range(node, idx, idx + npages);
+	node->nr_free += npages;
+	release(&node->lock);
+}
+
+int buddy_init(void) {
+	buddy_node	*node;
+	memory_info *mem;
+	uint32_t	 map_npages;
+	int			 id;
+
+	for_each_mem(id, mem) {
+		node = &buddy_all_nodes[mem->numa_node_id];
+
+		initlock(&node->lock, "buddy");
+		node->start_pfn = pa_to_pfn(mem->base_address);
+		node->npages	= mem->ram_size >> PGSHIFT;
+		node->nr_free	= 0;
+		for (int order = 0; order <= MAX_ORDER; order++) {
+			INIT_LIST_HEAD(&node->free_area[order].free_list);
+			node->free_area[order].nr_free = 0;
+		}
+
+		// the mem_map lives in the node it describes, every page
+		// is reserved until bootmem tells us it is free.
+		map_npages =
+			(node->npages * sizeof(struct page) + PGSIZE - 1) >> PGSHIFT;
+		node->mem_map = bootmem_alloc_node(mem->numa_node_id, map_npages);
+		if (node->mem_map == 0) {
+			pr_err("not enough memory space for mem_map of numa node %d.",
+				   mem->numa_node_id);
+			return -1;
+		}
+		for (uint64_t i = 0; i < node->npages; i++) {
+			INIT_LIST_HEAD(&node->mem_map[i].list);
+			node->mem_map[i].flags = PG_reserved;
+			node->mem_map[i].order = 0;
+			node->mem_map[i].slab	= 0;
+			node->mem_map[i].refcount = 0;
+		}
+	}
+
+	for (int i = 0; i < MAX_CPU; i++)
+		INIT_LIST_HEAD(&pcp_all_cpus[i].list);
+
+	for_each_mem(id, mem) {
+		struct zero_pool *pool = &zero_pools[mem->numa_node_id];
+
+		initlock(&pool->lock, "zero_pool");
+		INIT_LIST_HEAD(&pool->list);
+		pool->high		= min(ZERO_POOL_HIGH,
+							  buddy_all_nodes[mem->numa_node_id].npages / 64);
+		pool->low		= pool->high / 4;
+		pool->refilling = pool->high > 0;
+	}
+
+	bootmem_free_all(buddy_free_bootmem);
+
+	register_mm_handlers();
+
+	buddy_info();
+
+	return 0;
+}
+
+// Print free blocks of each order of each numa node,
+// and the usage of the per-cpu page lists.
+void buddy_info(void) {
+	struct per_cpu_pages *pcp;
+	buddy_node			 *node;
+	int					  nid;
+
+	for_each_buddy_node(nid, node) {
+		acquire(&node->lock);
+		printk("Buddy[%d]:\tfree %lu pages\t", nid, node->nr_free);
+		for (int order = 0; order <= MAX_ORDER; order++)
+			printk("%lu ", node->free_area[order].nr_free);
+		printk("\n");
+		release(&node->lock);
+	}
+
+	for (int i = 0; i < MAX_CPU; i++) {
+		pcp = &pcp_all_cpus[i];
+		if (pcp->allocs == 0 && pcp->count == 0)
+			continue;
+		printk("PCP[%d]:\tcached %d pages\thit %lu/%lu\trefill %lu\tdrain %lu\n",
+			   i, pcp->count, pcp->hits, pcp->allocs, pcp->refills, pcp->drains);
+	}
+
+	for_each_buddy_node(nid, node) {
+		struct zero_pool *pool = &zero_pools[nid];
+
+		printk("ZeroPool[%d]:\t%d pages (low %d high %d)\thit %lu miss %lu"
+			   "\tzeroed %lu\n",
+			   nid, pool->count, pool->low, pool->high, pool->hits,
+			   pool->misses, pool->zeroed);
+	}
+}
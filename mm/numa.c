@@ -0,0 +1,100 @@
+// NUMA topology for the page allocators.
+// Every node gets a fallback list of all nodes with memory, sorted by
+// the distance from it, so an allocation which can not be served by
+// the wanted node goes to the nearest one that still has free pages.
+
+#include "device_tree.h"
+#include "kernel.h"
+#include "mm.h"
+
+#define LOCAL_DISTANCE 10  // distance of a node to itself
+#define REMOTE_DISTANCE 20 // distance of nodes missing in the distance map
+
+int node_fallback[MAX_NUMA_NODE][MAX_NUMA_NODE];
+int nr_fallback_nodes;
+
+static struct numa_stat numa_stats[MAX_NUMA_NODE];
+
+int node_distance(int from, int to) {
+	distance *dist;
+	int		  id;
+
+	for_each_distance_entry(id, dist) {
+		if (dist->src == from && dist->dst == to)
+			return dist->value;
+	}
+	return from == to ? LOCAL_DISTANCE : REMOTE_DISTANCE;
+}
+
+// fallback order: nearer nodes first, the node itself first among
+// nodes of the same distance, then lower node ids.
+static int fallback_before(int nid, int a, int b) {
+	int da = node_distance(nid, a), db = node_distance(nid, b);
+
+	if (da != db)
+		return da < db;
+	if (a == nid || b == nid)
+		return a == nid;
+	return a < b;
+}
+
+// Build the fallback list of each node, must be called after the
+// device tree is parsed and before any page allocator is set up.
+void numa_init(void) {
+	memory_info *mem;
+	int			 id, i, j, k;
+
+	for (int nid = 0; nid < MAX_NUMA_NODE; nid++) {
+		nr_fallback_nodes = 0;
+		for_each_mem(id, mem) {
+			// insertion sort, the lists are at most MAX_NUMA_NODE long.
+			k = mem->numa_node_id;
+			i = nr_fallback_nodes++;
+			for (j = i; j > 0; j--) {
+				if (!fallback_before(nid, k, node_fallback[nid][j - 1]))
+					break;
+				node_fallback[nid][j] = node_fallback[nid][j - 1];
+			}
+			node_fallback[nid][j] = k;
+		}
+	}
+
+	numa_info();
+}
+
+// Count an allocation meant for node nid which was served by node
+// served.
+void numa_stat_account(int nid, int served, uint32_t npages) {
+	if (served == nid) {
+		__sync_fetch_and_add(&numa_stats[nid].hit, npages);
+	}
+	else {
+		__sync_fetch_and_add(&numa_stats[served].miss, npages);
+		__sync_fetch_and_add(&numa_stats[nid].foreign, npages);
+	}
+}
+
+struct numa_stat *numa_stat_of(int nid) { return &numa_stats[nid]; }
+
+// Print the fallback list and the allocation stats of each node.
+void numa_info(void) {
+	int nid;
+
+	for (nid = 0; nid < MAX_NUMA_NODE; nid++) {
+		struct numa_stat *stat = &numa_stats[nid];
+		int				  i;
+
+		for (i = 0; i < nr_fallback_nodes; i++) {
+			if (node_fallback[nid][i] == nid)
+				break;
+		}
+		if (i == nr_fallback_nodes)
+			continue; // node without memory
+
+		printk("NUMA[%d]:\tfallback", nid);
+		for (i = 0; i < nr_fallback_nodes; i++)
+			printk(" %d", node_fallback[nid][i]);
+		printk("\thit %lu\tmiss %lu\tforeign %lu pages\n", stat->hit,
+			   stat->miss, stat->foreign);
+	}
+}
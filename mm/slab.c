@@ -0,0 +1,273 @@
+// Slab allocator, caches of same-sized kernel objects.
+// Objects are carved out of slabs of 2^order pages taken from the page
+// allocator. Every cpu keeps a magazine of free objects, so the common
+// alloc/free path runs with interrupts off and without any lock; only
+// refilling or flushing a magazine takes the lock of one numa node's
+// slab lists.
+
+#include "slab.h"
+#include "device_tree.h"
+#include "kernel.h"
+#include "list.h"
+#include "math.h"
+#include "mm.h"
+#include "spinlock.h"
+
+#define SLAB_MIN_OBJS 8	 // try to fit at least so many objects in a slab
+#define SLAB_MAX_ORDER 3 // largest slab is 2^SLAB_MAX_ORDER pages
+#define SLAB_MAX_FREE 1	 // empty slabs kept by each node of a cache
+
+#define ALIGN(x, a) (((x) + (a)-1) & ~((a)-1))
+
+// Management data, at the beginning of every slab.
+struct slab {
+	struct list_head   list; // partial/full/free list of the node
+	struct kmem_cache *cachep;
+	void			  *freelist; // free objects, linked through the first word
+	uint32_t		   inuse;	 // objects out of the slab, incl. magazines
+	int				   nid;
+};
+
+static struct {
+	struct spinlock	 lock;
+	struct list_head caches;
+} cache_chain;
+
+void kmem_cache_init(void) {
+	initlock(&cache_chain.lock, "cache_chain");
+	INIT_LIST_HEAD(&cache_chain.caches);
+}
+
+// Create a cache of objects of size bytes, aligned to align bytes,
+// which must be a power of 2. Returns 0 if the cache cannot be set up.
+struct kmem_cache *kmem_cache_create(char *name, uint32_t size, uint32_t align) {
+	struct kmem_cache *cachep;
+
+	cachep = alloc_pages_exact(sizeof(struct kmem_cache));
+	if (cachep == 0)
+		return 0;
+	memset(cachep, 0, sizeof(struct kmem_cache));
+
+	align			= max(align, (uint32_t)sizeof(void *));
+	cachep->name	= name;
+	cachep->size	= ALIGN(max(size, (uint32_t)sizeof(void *)), align);
+	cachep->offset	= ALIGN(sizeof(struct slab), align);
+	cachep->nr_objs = 0;
+	for (cachep->order = 0; cachep->order <= SLAB_MAX_ORDER; cachep->order++) {
+		cachep->nr_objs =
+			((PGSIZE << cachep->order) - cachep->offset) / cachep->size;
+		if (cachep->nr_objs >= SLAB_MIN_OBJS || cachep->order == SLAB_MAX_ORDER)
+			break;
+	}
+	if (cachep->nr_objs == 0) {
+		pr_err("object of cache %s is too large: %d bytes.", name, size);
+		free_pages_exact(cachep, sizeof(struct kmem_cache));
+		return 0;
+	}
+
+	for (int nid = 0; nid < MAX_NUMA_NODE; nid++) {
+		struct kmem_cache_node *n = &cachep->nodes[nid];
+
+		initlock(&n->lock, "kmem_cache_node");
+		INIT_LIST_HEAD(&n->partial);
+		INIT_LIST_HEAD(&n->full);
+		INIT_LIST_HEAD(&n->free);
+	}
+
+	acquire(&cache_chain.lock);
+	list_add_tail(&cachep->list, &cache_chain.caches);
+	release(&cache_chain.lock);
+
+	return cachep;
+}
+
+// Allocate a new slab for node nid, with all of its objects free.
+// The pages come from the nearest node with free memory if nid has
+// none, slabp->nid says which. The slab is on no list yet and not
+// counted in nr_slabs, so no lock is needed.
+static struct slab *cache_grow(struct kmem_cache *cachep, int nid) {
+	struct slab *slabp;
+	char		 *obj;
+
+	slabp = alloc_pages_node(nid, 1 << cachep->order);
+	if (slabp == 0)
+		return 0;
+
+	for (int i = 0; i < (1 << cachep->order); i++) {
+		struct page *page = virt_to_page((char *)slabp + i * PGSIZE);
+
+		page->flags |= PG_slab;
+		page->slab = slabp;
+	}
+
+	INIT_LIST_HEAD(&slabp->list);
+	slabp->cachep	= cachep;
+	slabp->freelist = 0;
+	slabp->inuse	= 0;
+	slabp->nid		= pfn_to_nid(pa_to_pfn((uint64_t)slabp));
+
+	// chain the objects so they are handed out in address order.
+	obj = (char *)slabp + cachep->offset + (cachep->nr_objs - 1) * cachep->size;
+	for (int i = 0; i < cachep->nr_objs; i++, obj -= cachep->size) {
+		*(void **)obj	= slabp->freelist;
+		slabp->freelist = obj;
+	}
+
+	return slabp;
+}
+
+// Give the pages of an empty slab back to the page allocator.
+// Caller must hold the lock of the node, the slab is off all lists.
+static void cache_destroy_slab(struct kmem_cache *cachep, struct slab *slabp) {
+	for (int i = 0; i < (1 << cachep->order); i++) {
+		struct page *page = virt_to_page((char *)slabp + i * PGSIZE);
+
+		page->flags &= ~PG_slab;
+		page->slab = 0;
+	}
+
+	cachep->nodes[slabp->nid].nr_slabs--;
+	free_pages(slabp, 1 << cachep->order);
+}
+
+// Move free objects of slabp into the magazine, until it has
+// SLAB_BATCH, and put the slab on the partial or full list of n.
+// Caller must hold n->lock.
+static void cache_take_objs(struct kmem_cache_node *n, struct magazine *mag,
+							struct slab *slabp) {
+	void *obj;
+
+	while (slabp->freelist && mag->avail < SLAB_BATCH) {
+		obj				= slabp->freelist;
+		slabp->freelist = *(void **)obj;
+		slabp->inuse++;
+		mag->objs[mag->avail++] = obj;
+	}
+	list_move(&slabp->list, slabp->freelist ? &n->partial : &n->full);
+}
+
+// Move up to SLAB_BATCH objects of node nid into the magazine.
+// Interrupts are off, so the magazine stays ours.
+static void
+cache_refill(struct kmem_cache *cachep, struct magazine *mag, int nid) {
+	struct kmem_cache_node *n = &cachep->nodes[nid];
+	struct slab			*slabp;
+
+	acquire(&n->lock);
+	while (mag->avail < SLAB_BATCH) {
+		if (!list_empty(&n->partial)) {
+			slabp = list_first_entry(&n->partial, struct slab, list);
+		}
+		else if (!list_empty(&n->free)) {
+			slabp = list_first_entry(&n->free, struct slab, list);
+			n->nr_free--;
+		}
+		else {
+			// grow without holding the node: the page allocator may
+			// take a while, and the slab goes on the lists of the
+			// node its pages come from, which may not be nid.
+			release(&n->lock);
+			if ((slabp = cache_grow(cachep, nid)) == 0)
+				return;
+			n = &cachep->nodes[slabp->nid];
+			acquire(&n->lock);
+			n->nr_slabs++;
+			cache_take_objs(n, mag, slabp);
+			if (slabp->nid != nid)
+				break; // nid is out of memory, don't grow remote slabs
+			continue;
+		}
+		cache_take_objs(n, mag, slabp);
+	}
+	release(&n->lock);
+}
+
+// Put an object back into the slab it was carved from.
+static void cache_put_obj(struct kmem_cache *cachep, void *objp) {
+	struct slab			*slabp = virt_to_page(objp)->slab;
+	struct kmem_cache_node *n	  = &cachep->nodes[slabp->nid];
+
+	acquire(&n->lock);
+	*(void **)objp	= slabp->freelist;
+	slabp->freelist = objp;
+	if (slabp->inuse-- == cachep->nr_objs)
+		list_move(&slabp->list, &n->partial);
+	if (slabp->inuse == 0) {
+		if (n->nr_free < SLAB_MAX_FREE) {
+			list_move(&slabp->list, &n->free);
+			n->nr_free++;
+		}
+		else {
+			list_del(&slabp->list);
+			cache_destroy_slab(cachep, slabp);
+		}
+	}
+	release(&n->lock);
+}
+
+// Return the SLAB_BATCH oldest objects of a full magazine to their slabs.
+static void cache_flush(struct kmem_cache *cachep, struct magazine *mag) {
+	for (int i = 0; i < SLAB_BATCH; i++)
+		cache_put_obj(cachep, mag->objs[i]);
+
+	mag->avail -= SLAB_BATCH;
+	memmove(mag->objs, mag->objs + SLAB_BATCH, mag->avail * sizeof(void *));
+}
+
+// Allocate an object from the cache, preferring slabs of the numa
+// node of the current cpu. Returns 0 if out of memory.
+void *kmem_cache_alloc(struct kmem_cache *cachep) {
+	struct magazine *mag;
+	void			 *objp = 0;
+
+	push_off();
+	mag = &cachep->cpu_cache[cpu_id()];
+	if (mag->avail == 0)
+		cache_refill(cachep, mag, cpu_of(cpu_id())->numa_node_id);
+	if (mag->avail > 0)
+		objp = mag->objs[--mag->avail];
+	pop_off();
+
+	return objp;
+}
+
+void *kmem_cache_zalloc(struct kmem_cache *cachep) {
+	void *objp = kmem_cache_alloc(cachep);
+
+	if (objp)
+		memset(objp, 0, cachep->size);
+	return objp;
+}
+
+void kmem_cache_free(struct kmem_cache *cachep, void *objp) {
+	struct magazine *mag;
+	struct page		*page = virt_to_page(objp);
+
+	if (page == 0 || !(page->flags & PG_slab) ||
+		((struct slab *)page->slab)->cachep != cachep)
+		panic("kmem_cache_free: object not from this cache");
+
+	push_off();
+	mag = &cachep->cpu_cache[cpu_id()];
+	if (mag->avail == SLAB_MAGAZINE_SIZE)
+		cache_flush(cachep, mag);
+	mag->objs[mag->avail++] = objp;
+	pop_off();
+}
+
+// Print the usage of every cache.
+void kmem_cache_info(void) {
+	struct kmem_cache *cachep;
+	uint32_t		   nr_slabs;
+
+	acquire(&cache_chain.lock);
+	list_for_each_entry(cachep, &cache_chain.caches, list) {
+		nr_slabs = 0;
+		for (int nid = 0; nid < MAX_NUMA_NODE; nid++)
+			nr_slabs += cachep->nodes[nid].nr_slabs;
+		printk("Slab[%s]:\tobjsize %d\tobjs/slab %d\tpages/slab %d\tslabs %d\n",
+			   cachep->name, cachep->size, cachep->nr_objs, 1 << cachep->order,
+			   nr_slabs);
+	}
+	release(&cache_chain.lock);
+}
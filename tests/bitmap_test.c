@@ -0,0 +1,202 @@
+// Host test and benchmark of include/bitmap.h.
+//
+//   make test-bitmap
+//
+// Checks the word-at-a-time searches and range ops against a naive
+// bit-by-bit version, then prints the time of both on a bootmem-like
+// map: long used runs with a few free pages in between.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "bitmap.h"
+
+#define MAX_BITS 1000 // not a multiple of 64, the last word is partial
+#define MAX_WORDS ((MAX_BITS + 63) / 64)
+
+static int failures;
+
+#define CHECK(cond, ...)                                                     \
+	do {                                                                     \
+		if (!(cond)) {                                                       \
+			printf("FAIL %s:%d: ", __FILE__, __LINE__);                      \
+			printf(__VA_ARGS__);                                             \
+			printf("\n");                                                    \
+			failures++;                                                      \
+		}                                                                    \
+	} while (0)
+
+static uint64_t naive_find_next(const uint64_t *map, uint64_t size,
+								uint64_t start, int set) {
+	for (; start < size; start++)
+		if (bitmap_test(map, start) == set)
+			return start;
+	return size;
+}
+
+static uint64_t naive_find_zero_area(const uint64_t *map, uint64_t size,
+									 uint64_t start, uint64_t n) {
+	uint64_t i;
+
+	for (; start + n <= size; start++) {
+		for (i = 0; i < n && !bitmap_test(map, start + i); i++)
+			;
+		if (i == n)
+			return start;
+	}
+	return size;
+}
+
+// Compare every search of map, of size bits, with the naive one.
+static void check_searches(const uint64_t *map, uint64_t size, const char *what) {
+	static const uint64_t areas[] = {1, 2, 63, 64, 65, 130};
+
+	for (uint64_t s = 0; s <= size; s++) {
+		CHECK(bitmap_find_next_set(map, size, s) ==
+				  naive_find_next(map, size, s, 1),
+			  "%s: find_next_set(size %lu, start %lu)", what, size, s);
+		CHECK(bitmap_find_next_zero(map, size, s) ==
+				  naive_find_next(map, size, s, 0),
+			  "%s: find_next_zero(size %lu, start %lu)", what, size, s);
+		for (int k = 0; k < sizeof(areas) / sizeof(areas[0]); k++)
+			CHECK(bitmap_find_zero_area(map, size, s, areas[k]) ==
+					  naive_find_zero_area(map, size, s, areas[k]),
+				  "%s: find_zero_area(size %lu, start %lu, n %lu)", what, size,
+				  s, areas[k]);
+	}
+}
+
+static void test_word_boundaries(void) {
+	static const uint64_t sizes[] = {1, 63, 64, 65, 127, 128, 129, MAX_BITS};
+	static const uint64_t bits[]  = {0, 1, 62, 63, 64, 65, 127, 128, 999};
+	uint64_t			  map[MAX_WORDS];
+
+	for (int i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+		memset(map, 0, sizeof(map));
+		check_searches(map, sizes[i], "all clear");
+		for (int j = 0; j < sizeof(bits) / sizeof(bits[0]); j++)
+			bitmap_set(map, bits[j]);
+		check_searches(map, sizes[i], "single bits");
+		// set bits past size in the last word must not be found.
+		memset(map, 0xff, sizeof(map));
+		bitmap_clear_range(map, 0, sizes[i]);
+		check_searches(map, sizes[i], "set past size");
+	}
+}
+
+static void test_all_set(void) {
+	uint64_t map[MAX_WORDS];
+
+	memset(map, 0, sizeof(map));
+	bitmap_set_range(map, 0, MAX_BITS);
+	for (uint64_t i = 0; i < MAX_BITS; i++)
+		CHECK(bitmap_test(map, i), "set_range: bit %lu clear", i);
+	CHECK(bitmap_find_next_zero(map, MAX_BITS, 0) == MAX_BITS,
+		  "all set: found a zero");
+	CHECK(bitmap_find_zero_area(map, MAX_BITS, 0, 1) == MAX_BITS,
+		  "all set: found an area");
+	check_searches(map, MAX_BITS, "all set");
+}
+
+// Zero areas that start and end inside words and span whole ones.
+static void test_zero_areas(void) {
+	uint64_t map[MAX_WORDS];
+
+	for (uint64_t start = 0; start < 200; start += 7) {
+		for (uint64_t n = 1; start + n <= MAX_BITS; n = n * 2 + 1) {
+			memset(map, 0xff, sizeof(map));
+			bitmap_clear_range(map, start, n);
+			for (uint64_t i = 0; i < MAX_BITS; i++)
+				CHECK(bitmap_test(map, i) == (i < start || i >= start + n),
+					  "clear_range(%lu, %lu): bit %lu", start, n, i);
+			CHECK(bitmap_find_zero_area(map, MAX_BITS, 0, n) == start,
+				  "zero area [%lu, +%lu) not found", start, n);
+			CHECK(bitmap_find_zero_area(map, MAX_BITS, 0, n + 1) == MAX_BITS,
+				  "zero area [%lu, +%lu) too long", start, n + 1);
+		}
+	}
+}
+
+static void test_random(void) {
+	uint64_t map[MAX_WORDS];
+
+	srand(1);
+	for (int round = 0; round < 20; round++) {
+		memset(map, 0, sizeof(map));
+		// runs of random length, dense or sparse depending on the round
+		for (uint64_t i = 0; i < MAX_BITS;) {
+			uint64_t n = rand() % 150 + 1;
+
+			if (i + n > MAX_BITS)
+				n = MAX_BITS - i;
+			if (rand() % 4 < round % 4)
+				bitmap_set_range(map, i, n);
+			i += n;
+		}
+		check_searches(map, MAX_BITS, "random");
+	}
+}
+
+#define BENCH_BITS (1 << 20) // 4GB of pages
+#define BENCH_ROUNDS 20
+
+static double now(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Time finding every free area of n pages in a map where one page in
+// 4096 is free, as bootmem sees once most of memory is handed out.
+static void bench(void) {
+	uint64_t *map = malloc(BENCH_BITS / 8);
+	uint64_t  found, naive_found;
+	double	  t0, t_word, t_naive;
+
+	memset(map, 0xff, BENCH_BITS / 8);
+	for (uint64_t i = 0; i < BENCH_BITS; i += 4096)
+		bitmap_clear_range(map, i + 1000, 8);
+
+	printf("bench: %d bits, one 8-bit free area every 4096\n", BENCH_BITS);
+	printf("\tn\tword (ms)\tnaive (ms)\n");
+	for (uint64_t n = 1; n <= 8; n *= 2) {
+		found = naive_found = 0;
+		t0					= now();
+		for (int r = 0; r < BENCH_ROUNDS; r++)
+			for (uint64_t s = 0;
+				 (s = bitmap_find_zero_area(map, BENCH_BITS, s, n)) < BENCH_BITS;
+				 s += n)
+				found++;
+		t_word = now() - t0;
+		t0	   = now();
+		for (int r = 0; r < BENCH_ROUNDS; r++)
+			for (uint64_t s = 0;
+				 (s = naive_find_zero_area(map, BENCH_BITS, s, n)) < BENCH_BITS;
+				 s += n)
+				naive_found++;
+		t_naive = now() - t0;
+		CHECK(found == naive_found, "bench: %lu areas, naive %lu", found,
+			  naive_found);
+		printf("\t%lu\t%.2f\t\t%.2f\n", n, t_word * 1e3 / BENCH_ROUNDS,
+			   t_naive * 1e3 / BENCH_ROUNDS);
+	}
+	free(map);
+}
+
+int main(int argc, char *argv[]) {
+	test_word_boundaries();
+	test_all_set();
+	test_zero_areas();
+	test_random();
+	if (failures) {
+		printf("bitmap_test: %d failures\n", failures);
+		return 1;
+	}
+	printf("bitmap_test: ok\n");
+	if (argc < 2 || strcmp(argv[1], "-q") != 0)
+		bench();
+	return failures != 0;
+}